@@ -45,22 +45,31 @@ DEFINE_GUID(GUID_DEVINTERFACE_VIRTUAL_MINIPORT_DEVICE, 0xa1629363, 0xfb34, 0x469
 //
 // Type definitions for IOCTLs
 //
-#define VIRTUAL_MINIPORT_MAX_TIERS 2
+#define VIRTUAL_MINIPORT_MAX_FILE_TIERS 4
+#define VIRTUAL_MINIPORT_MAX_TIERS (2 + VIRTUAL_MINIPORT_MAX_FILE_TIERS)
+#define VIRTUAL_MINIPORT_MAX_TIER_LOCATION 128
+#define VIRTUAL_MINIPORT_MAX_ALLOCATION_UNIT (0x00040000UL)
 typedef enum _VIRTUAL_MINIPORT_TIER {
     VMTierMin,
     VMTierNone = VMTierMin,
     VMTierPhysicalMemory,
     VMTierFile,
-    VMTierMax = VMTierFile
+    VMTierCompressedMemory,    // Holds the file tier blocks compressed; adds no capacity
+    VMTierMax = VMTierCompressedMemory
 }VIRTUAL_MINIPORT_TIER, *PVIRTUAL_MINIPORT_TIER;
 
 typedef struct _VIRTUAL_MINIPORT_TARGET_TIER_DESCRIPTOR {
     VIRTUAL_MINIPORT_TIER Tier;
-    ULONGLONG TierSize;  // Unit: MegaBytes
+    ULONGLONG TierSize;  // Unit: Bytes
 
     //
     // Tier specific details
     //
+    // File tier; a file tier may be described up to VIRTUAL_MINIPORT_MAX_FILE_TIERS
+    // times, on volumes of their own, the fastest first. Location is the folder
+    // its backing file is kept in, with a trailing \; empty for MetadataLocation.
+    //
+    WCHAR Location [VIRTUAL_MINIPORT_MAX_TIER_LOCATION];
 }VIRTUAL_MINIPORT_TARGET_TIER_DESCRIPTOR, *PVIRTUAL_MINIPORT_TARGET_TIER_DESCRIPTOR;
 
 typedef struct _VIRTUAL_MINIPORT_DUMMY_DATA {
@@ -112,17 +121,63 @@ typedef struct _VIRTUAL_MINIPORT_CREATE_TARGET_DESCRIPTOR {
     //
 
     ULONGLONG Size;                        // Unit: Bytes
-    VIRTUAL_MINIPORT_BLOCK_SIZE BlockSize; // Unit: Bytes
+    VIRTUAL_MINIPORT_BLOCK_SIZE BlockSize; // Unit: Bytes; sector size of the Luns
     ULONG TierCount;
     VIRTUAL_MINIPORT_TARGET_TIER_DESCRIPTOR TierDescription [VIRTUAL_MINIPORT_MAX_TIERS];
+    BOOLEAN Deduplication;                 // Blocks of the same data are stored once
+
+    //
+    // Blocks are allocated, mapped and moved between the tiers in allocation
+    // units; a power of two multiple of BlockSize, up to
+    // VIRTUAL_MINIPORT_MAX_ALLOCATION_UNIT. Sectors are addressed within
+    // them. Zero for BlockSize.
+    //
+    ULONG AllocationUnit;                  // Unit: Bytes
+
+    //
+    // Identity of a device with a file tier; its backing file and block map
+    // are kept under MetadataLocation, and a device created again with the
+    // same identity and geometry restores them. Zero creates a new device.
+    //
+    GUID DeviceId;
 }VIRTUAL_MINIPORT_CREATE_TARGET_DESCRIPTOR, *PVIRTUAL_MINIPORT_CREATE_TARGET_DESCRIPTOR;
 
 typedef struct _VIRTUAL_MINIPORT_TARGET_DEVICE_DETAILS {
     ULONGLONG Size;                        // Bytes
-    VIRTUAL_MINIPORT_BLOCK_SIZE BlockSize; // Bytes
+    VIRTUAL_MINIPORT_BLOCK_SIZE BlockSize; // Bytes; sector size
+    ULONG AllocationUnit;                  // Bytes; size of the blocks counted below
     ULONGLONG MaxBlocks;
     ULONG LogicalDeviceCount;
     ULONG TierCount;
+
+    //
+    // Deduplication ratio is MappedBlocks / AllocatedBlocks
+    //
+    BOOLEAN Deduplication;
+    ULONGLONG MappedBlocks;                // Logical blocks mapped
+    ULONGLONG AllocatedBlocks;             // Physical blocks holding them
+
+    //
+    // Compression ratio is CompressedBlocks * AllocationUnit / CompressedBytes
+    //
+    ULONGLONG CompressedTierSize;          // Bytes
+    ULONGLONG CompressedBlocks;            // File tier blocks held compressed
+    ULONGLONG CompressedBytes;             // Bytes of their compressed data
+
+    //
+    // Persistent block map of a device with a file tier
+    //
+    GUID DeviceId;
+    BOOLEAN Restored;                      // Block map was restored at the creation
+    ULONGLONG LostBlocks;                  // Written blocks lost by an unclean shutdown
+    ULONGLONG WarmBlocks;                  // RAM tier blocks still being loaded after a clean shutdown
+
+    //
+    // Levels of the file tier, the fastest first
+    //
+    ULONG FileTierCount;
+    ULONGLONG FileTierBlocks [VIRTUAL_MINIPORT_MAX_FILE_TIERS];
+    ULONGLONG FileTierFreeBlocks [VIRTUAL_MINIPORT_MAX_FILE_TIERS];
 }VIRTUAL_MINIPORT_TARGET_DEVICE_DETAILS, *PVIRTUAL_MINIPORT_TARGET_DEVICE_DETAILS;
 
 typedef struct _VIRTUAL_MINIPORT_TARGET_DETAILS {
@@ -154,13 +209,14 @@ typedef struct _VIRTUAL_MINIPORT_CREATE_LUN_DESCRIPTOR {
     UCHAR Bus;
     UCHAR Target;
     ULONGLONG Size;
-    BOOLEAN ThinProvision; // for now will be false always
+    BOOLEAN ThinProvision; // Blocks are committed as they are written
 }VIRTUAL_MINIPORT_CREATE_LUN_DESCRIPTOR, *PVIRTUAL_MINIPORT_CREATE_LUN_DESCRIPTOR;
 
 typedef struct _VIRTUAL_MINIPORT_LOGICAL_DEVICE_DETAILS {
     ULONGLONG Size;                        // Bytes
-    VIRTUAL_MINIPORT_BLOCK_SIZE BlockSize; // Bytes
-    ULONGLONG MaxBlocks;
+    VIRTUAL_MINIPORT_BLOCK_SIZE BlockSize; // Bytes; sector size
+    ULONG AllocationUnit;                  // Bytes
+    ULONGLONG MaxBlocks;                   // Sectors
     BOOLEAN ThinProvison;
 }VIRTUAL_MINIPORT_LOGICAL_DEVICE_DETAILS, *PVIRTUAL_MINIPORT_LOGICAL_DEVICE_DETAILS;
 
@@ -179,6 +235,77 @@ typedef struct _VIRTUAL_MINIPORT_LUN_DETAILS {
     VIRTUAL_MINIPORT_LOGICAL_DEVICE_DETAILS DeviceDetails;
 }VIRTUAL_MINIPORT_LUN_DETAILS, *PVIRTUAL_MINIPORT_LUN_DETAILS;
 
+//
+// Heat of a logical device is tracked per region; a run of its blocks of
+// RegionSize bytes. Access counts of a region are halved for every
+// DecayInterval it is not accessed in.
+//
+
+#define VIRTUAL_MINIPORT_MAX_HEAT_REGIONS 256
+
+typedef struct _VIRTUAL_MINIPORT_HEAT_REGION {
+    ULONG Reads;                           // Decayed read count
+    ULONG Writes;                          // Decayed write count
+    ULONG Age;                             // DecayIntervals since the last access; MAXULONG if never accessed
+    ULONG MemoryBlocks;                    // Blocks of the region in the RAM tier
+}VIRTUAL_MINIPORT_HEAT_REGION, *PVIRTUAL_MINIPORT_HEAT_REGION;
+
+typedef struct _VIRTUAL_MINIPORT_LOGICAL_DEVICE_HEAT_MAP {
+    ULONGLONG RegionSize;                  // Bytes
+    ULONG DecayInterval;                   // Milliseconds
+    ULONG RegionCount;
+
+    //
+    // Must be the last; RegionCount regions
+    //
+    VIRTUAL_MINIPORT_HEAT_REGION Regions [1];
+}VIRTUAL_MINIPORT_LOGICAL_DEVICE_HEAT_MAP, *PVIRTUAL_MINIPORT_LOGICAL_DEVICE_HEAT_MAP;
+
+typedef struct _VIRTUAL_MINIPORT_LUN_HEAT_MAP {
+    //
+    // Input
+    //
+    GUID AdapterId;
+    UCHAR Bus;
+    UCHAR Target;
+    UCHAR Lun;
+
+    //
+    // Output
+    //
+    VIRTUAL_MINIPORT_LOGICAL_DEVICE_HEAT_MAP HeatMap;
+}VIRTUAL_MINIPORT_LUN_HEAT_MAP, *PVIRTUAL_MINIPORT_LUN_HEAT_MAP;
+
+//
+// Requests of the Luns of an adapter take turns in the proportion of the
+// weight of their Lun, once they have to wait for each other. Lun can also
+// be limited to a rate of requests and of bytes; 0 is unlimited.
+//
+
+#define VIRTUAL_MINIPORT_DEFAULT_LUN_WEIGHT 100
+#define VIRTUAL_MINIPORT_MAX_LUN_WEIGHT 10000
+
+typedef struct _VIRTUAL_MINIPORT_LUN_QOS {
+    //
+    // Input
+    //
+    GUID AdapterId;
+    UCHAR Bus;
+    UCHAR Target;
+    UCHAR Lun;
+    ULONG Weight;                          // 1 - VIRTUAL_MINIPORT_MAX_LUN_WEIGHT
+    ULONGLONG IopsLimit;                   // Requests per second
+    ULONGLONG BandwidthLimit;              // Bytes per second
+
+    //
+    // Output
+    //
+    ULONG QueuedRequests;                  // Waiting their turn
+    ULONGLONG Requests;                    // Read/write requests dispatched
+    ULONGLONG Bytes;                       // Bytes of the requests dispatched
+    ULONGLONG Throttled;                   // Times the Lun was held back by its limits
+}VIRTUAL_MINIPORT_LUN_QOS, *PVIRTUAL_MINIPORT_LUN_QOS;
+
 typedef struct _VIRTUAL_MINIPORT_IOCTL_DESCRIPTOR {
     SRB_IO_CONTROL SrbIoControl;
 
@@ -198,6 +325,12 @@ typedef struct _VIRTUAL_MINIPORT_IOCTL_DESCRIPTOR {
         VIRTUAL_MINIPORT_BUS_DETAILS BusDetails;
         VIRTUAL_MINIPORT_TARGET_DETAILS TargetDetails;
         VIRTUAL_MINIPORT_LUN_DETAILS LunDetails;
+        VIRTUAL_MINIPORT_LUN_HEAT_MAP LunHeatMap;
+
+        //
+        // Set
+        //
+        VIRTUAL_MINIPORT_LUN_QOS LunQos;
     }RequestResponse;
 
 }VIRTUAL_MINIPORT_IOCTL_DESCRIPTOR, *PVIRTUAL_MINIPORT_IOCTL_DESCRIPTOR;
@@ -295,7 +428,23 @@ typedef enum _IOCTL_VIRTUAL_MINIPORT {
     // Output - PVIRTUAL_MINIPORT_LUN_DETAILS
     //
 
-    IOCTL_VIRTUAL_MINIPORT_QUERY_LUN_DETAILS
+    IOCTL_VIRTUAL_MINIPORT_QUERY_LUN_DETAILS,
+
+    //
+    // Query Lun heat map IOCTL, allows us to request the heat of the regions of a Lun
+    // Input - PVIRTUAL_MINIPORT_LUN_ADDRESS
+    // Output - PVIRTUAL_MINIPORT_LUN_HEAT_MAP
+    //
+
+    IOCTL_VIRTUAL_MINIPORT_QUERY_LUN_HEAT_MAP,
+
+    //
+    // Set Lun QoS IOCTL, allows us to set the weight and the limits of a Lun
+    // Input - PVIRTUAL_MINIPORT_LUN_QOS
+    // Output - PVIRTUAL_MINIPORT_LUN_QOS, with the statistics of the Lun
+    //
+
+    IOCTL_VIRTUAL_MINIPORT_SET_LUN_QOS
 }IOCTL_VIRTUAL_MINIPORT, *PIOCTL_VIRTUAL_MINIPORT;
 
 #endif //__VIRTUAL_MINIPORT_COMMON_H_
\ No newline at end of file
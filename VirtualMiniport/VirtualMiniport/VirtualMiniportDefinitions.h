@@ -92,6 +92,7 @@ typedef enum _VM_DEVICE_STATE {
     VMDeviceStarted,           // Ready to process the requests
     VMDeviceStopPending,       // New requests will be rejected, queue requests being processed
     VMDeviceStopped,           // Ready to be detached
+    VMDeviceDetachPending,     // Device is unlinked from parent, outstanding requests being drained
     VMDeviceDetached,          // Device is detached, ready to be cleaned up
     VMDeviceStateUnknown = -1  // For unknown inititializations
 }VM_DEVICE_STATE, *PVM_DEVICE_STATE;
@@ -109,6 +110,10 @@ typedef struct _VIRTUAL_MINIPORT_DEVICE_EXTENSION *PVIRTUAL_MINIPORT_DEVICE_EXTE
 // SCSI type definitions
 //
 
+#define VIRTUAL_MINIPORT_VPD_PAGE_SIZE 64                 // Bytes; fits the largest VPD page we report
+#define VIRTUAL_MINIPORT_MAX_UNMAP_DESCRIPTORS 256
+#define VIRTUAL_MINIPORT_CDB_WRITE_SAME_UNMAP 0x08        // UNMAP bit of byte 1 of WRITE SAME(10/16)
+
 /*++
 
     Represents the extended SRB context; allocated by storport
@@ -133,6 +138,18 @@ typedef struct _VIRTUAL_MINIPORT_SRB_EXTENSION {
     //
     PVIRTUAL_MINIPORT_ADAPTER_EXTENSION Adapter; 
     PSCSI_REQUEST_BLOCK Srb;                        // Pointer to SRB that we are part of
+
+    //
+    // Read/write on the logical device; it is suspended while it waits, and
+    // the SRB is resumed to the worker to continue it
+    //
+    VIRTUAL_MINIPORT_DEVICE_IO DeviceIo;
+    BOOLEAN Resumed;
+
+    //
+    // Unmap runs a device I/O per block descriptor; index of the one running
+    //
+    ULONG UnmapDescriptorIndex;
 }VIRTUAL_MINIPORT_SRB_EXTENSION, *PVIRTUAL_MINIPORT_SRB_EXTENSION;
 
 
@@ -144,7 +161,7 @@ typedef struct _VIRTUAL_MINIPORT_SRB_EXTENSION {
 
 #define VIRTUAL_MINIPORT_SIGNATURE_LUN 'VLun'
 typedef struct _VIRTUAL_MINIPORT_LUN {
-    LIST_ENTRY List;    // Not used
+    LIST_ENTRY List;    // Lun table of the adapter, while started
     ULONG Signature;
     VM_TYPE Type;
     VM_DEVICE_STATE State;
@@ -157,6 +174,13 @@ typedef struct _VIRTUAL_MINIPORT_LUN {
     VIRTUAL_MINIPORT_LOGICAL_DEVICE Device;
 
     PVIRTUAL_MINIPORT_TARGET Target; // Allow to get back to Target from Lun
+    ULONG Address;                   // VIRTUAL_MINIPORT_LUN_ADDRESS; while in the Lun table
+
+    //
+    // Read/write requests of the Lun take turns on the scheduler of the
+    // adapter through the flow; attached while in the Lun table
+    //
+    VIRTUAL_MINIPORT_SCHEDULER_FLOW Flow;
 }VIRTUAL_MINIPORT_LUN, *PVIRTUAL_MINIPORT_LUN;
 
 /*++
@@ -226,6 +250,20 @@ typedef struct _VIRTUAL_MINIPORT_BUS {
 
 --*/
 
+//
+// Started Luns are looked up by their address at DISPATCH_LEVEL, where the
+// locks of the hierarchy cannot be acquired; they are kept in a hash table of
+// the adapter, under a spinlock of its own
+//
+
+#define VIRTUAL_MINIPORT_LUN_TABLE_BUCKETS 64
+
+#define VIRTUAL_MINIPORT_LUN_ADDRESS(_BusId_, _TargetId_, _LunId_) \
+    ((((ULONG) (_BusId_)) << 16) | (((ULONG) (_TargetId_)) << 8) | ((ULONG) (_LunId_)))
+
+#define VIRTUAL_MINIPORT_LUN_BUCKET(_Address_) \
+    ((((_Address_) >> 16) ^ ((_Address_) >> 8) ^ (_Address_)) % VIRTUAL_MINIPORT_LUN_TABLE_BUCKETS)
+
 #define VIRTUAL_MINIPORT_SIGNATURE_ADAPTER_EXTENSION 'VAda'
 typedef struct _VIRTUAL_MINIPORT_ADAPTER_EXTENSION {
     LIST_ENTRY List;
@@ -249,6 +287,9 @@ typedef struct _VIRTUAL_MINIPORT_ADAPTER_EXTENSION {
     ULONG MaxBusCount;
     //LIST_ENTRY Buses;
     PVIRTUAL_MINIPORT_BUS *Buses;
+
+    VM_LOCK LunTableLock;
+    LIST_ENTRY LunTable [VIRTUAL_MINIPORT_LUN_TABLE_BUCKETS];
 }VIRTUAL_MINIPORT_ADAPTER_EXTENSION, *PVIRTUAL_MINIPORT_ADAPTER_EXTENSION;
 
 /*++
@@ -302,6 +343,23 @@ typedef struct _VIRTUAL_MINIPORT_CONFIGURATION {
 
     ULONGLONG DeviceSizeMax;
     UNICODE_STRING MetadataLocation;
+
+    ULONG DeviceShardCount;                         // 0 - One shard per CPU
+
+#define VIRTUAL_MINIPORT_FREE_MEMORY_LOW_WATERMARK 2
+#define VIRTUAL_MINIPORT_FREE_MEMORY_HIGH_WATERMARK 4
+#define VIRTUAL_MINIPORT_MAX_FREE_MEMORY_WATERMARK 50
+    ULONG DeviceFreeMemoryLowWatermark;             // Percent of RAM tier
+    ULONG DeviceFreeMemoryHighWatermark;            // Percent of RAM tier; 0 - No tier mover
+
+#define VIRTUAL_MINIPORT_PREFETCH_DEPTH 1024            // KB
+#define VIRTUAL_MINIPORT_MAX_PREFETCH_DEPTH 16384       // KB
+    ULONG DevicePrefetchDepth;                      // KB; 0 - No prefetch
+
+#define VIRTUAL_MINIPORT_SCHEDULER_MIN_THREADS 2
+#define VIRTUAL_MINIPORT_SCHEDULER_MAX_THREADS 256
+    ULONG SchedulerMinThreads;                      // Per adapter
+    ULONG SchedulerMaxThreads;                      // Per adapter; 0 - One per CPU
 }VIRTUAL_MINIPORT_CONFIGURATION, *PVIRTUAL_MINIPORT_CONFIGURATION;
 
 /*++
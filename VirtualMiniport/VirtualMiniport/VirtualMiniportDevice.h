@@ -100,6 +100,17 @@ VMDeviceBuildPhysicalDeviceDetails(
     _Inout_ PVIRTUAL_MINIPORT_TARGET_DEVICE_DETAILS DeviceDetails
     );
 
+NTSTATUS
+VMDeviceFlushPhysicalDevice(
+    _In_ PVIRTUAL_MINIPORT_TIERED_DEVICE Device,
+    _In_ BOOLEAN Shutdown
+    );
+
+NTSTATUS
+VMDeviceFlushFileTier(
+    _In_ PVIRTUAL_MINIPORT_TIERED_DEVICE Device
+    );
+
 //
 // Logical device APIs
 //
@@ -109,7 +120,8 @@ VMDeviceCreateLogicalDevice(
     _In_ PVIRTUAL_MINIPORT_ADAPTER_EXTENSION AdapterExtension,
     _Inout_ PVIRTUAL_MINIPORT_TIERED_DEVICE PhysicalDevice,
     _Inout_ PVIRTUAL_MINIPORT_LOGICAL_DEVICE LogicalDevice,
-    _In_ PVIRTUAL_MINIPORT_CREATE_LUN_DESCRIPTOR LunCreateDescriptor
+    _In_ PVIRTUAL_MINIPORT_CREATE_LUN_DESCRIPTOR LunCreateDescriptor,
+    _In_ UCHAR Lun
     );
 
 NTSTATUS
@@ -124,15 +136,51 @@ VMDeviceBuildLogicalDeviceDetails(
     _Inout_ PVIRTUAL_MINIPORT_LOGICAL_DEVICE_DETAILS DeviceDetails
     );
 
+NTSTATUS
+VMDeviceBuildLogicalDeviceHeatMap(
+    _In_ PVIRTUAL_MINIPORT_LOGICAL_DEVICE LogicalDevice,
+    _Inout_ PVIRTUAL_MINIPORT_LOGICAL_DEVICE_HEAT_MAP HeatMap
+    );
+
 NTSTATUS
 VMDeviceReadWriteLogicalDevice(
     _In_ PVIRTUAL_MINIPORT_ADAPTER_EXTENSION AdapterExtension,
     _In_ PVIRTUAL_MINIPORT_LOGICAL_DEVICE LogicalDevice,
     _In_ BOOLEAN Read,
     _Inout_ PVOID Buffer,
-    _In_ ULONGLONG LogicalBlockNumber,
-    _In_ ULONG BlockCount,
-    _Inout_ PULONG TransferredBytes
+    _In_ ULONGLONG SectorNumber,
+    _In_ ULONG SectorCount,
+    _Out_ PVIRTUAL_MINIPORT_DEVICE_IO DeviceIo,
+    _Inout_opt_ PVOID *StagingBuffer,
+    _In_ PVIRTUAL_MINIPORT_DEVICE_IO_RESUME ResumeRoutine,
+    _In_opt_ PVOID ResumeContext
+    );
+
+NTSTATUS
+VMDeviceTryReadWriteLogicalDevice(
+    _In_ PVIRTUAL_MINIPORT_LOGICAL_DEVICE LogicalDevice,
+    _In_ BOOLEAN Read,
+    _Inout_ PVOID Buffer,
+    _In_ ULONGLONG SectorNumber,
+    _In_ ULONG SectorCount,
+    _Out_ PULONG TransferredBytes
+    );
+
+NTSTATUS
+VMDeviceUnmapLogicalDevice(
+    _In_ PVIRTUAL_MINIPORT_ADAPTER_EXTENSION AdapterExtension,
+    _In_ PVIRTUAL_MINIPORT_LOGICAL_DEVICE LogicalDevice,
+    _In_ ULONGLONG SectorNumber,
+    _In_ ULONG SectorCount,
+    _Out_ PVIRTUAL_MINIPORT_DEVICE_IO DeviceIo,
+    _In_ PVIRTUAL_MINIPORT_DEVICE_IO_RESUME ResumeRoutine,
+    _In_opt_ PVOID ResumeContext
+    );
+
+NTSTATUS
+VMDeviceContinueReadWriteLogicalDevice(
+    _Inout_ PVIRTUAL_MINIPORT_DEVICE_IO DeviceIo,
+    _Inout_opt_ PVOID *StagingBuffer
     );
 
 #endif //__VIRTUAL_MINIPORT_DEVICE_H_
\ No newline at end of file
@@ -25,17 +25,25 @@ Abstract:
 #include <VirtualMiniportSupportRoutines.h>
 #include <VirtualMiniportCommon.h>
 #include <VirtualMiniportTrace.h>
+#include <VirtualMiniportFile.h>
 
 //
 // Device type definitions
 //
 
 //
-// Minimum device size is 10MB, and max is 4GB
+// Minimum device size is 10MB, and max is 16TB. Block count of a device is
+// further bound by the 32-bit block indices.
 //
 
 #define VIRTUAL_MINIPORT_MIN_DEVICE_SIZE (0x000A00000ULL)
-#define VIRTUAL_MINIPORT_MAX_DEVICE_SIZE (0x0FFFFFFFFULL)
+#define VIRTUAL_MINIPORT_MAX_DEVICE_SIZE (0x100000000000ULL)
+
+//
+// RAM tier is allocated in segments of 64MB; last segment may be shorter
+//
+
+#define VIRTUAL_MINIPORT_RAM_TIER_SEGMENT_SIZE (0x4000000ULL)
 
 //
 // Macro definitions for alignment
@@ -46,33 +54,106 @@ Abstract:
 #define VIRTUAL_MINIPORT_CEIL_ALIGN(_Size_, _Alignment_)(((ULONG_PTR) (_Size_) +_Alignment_ - 1) & ~(_Alignment_ - 1))
 
 /*
-    Represents a Lock for the block entries. This is an exclusive lock
-    We cannot use VM_LOCK as it adds an overhead of merging all lock types
-    Sometime later we can merge this lock type into VM_LOCK.
+    Block entries are packed; a 32-bit flags word carries the block lock, the
+    state bits and the tier, and blocks refer to each other by 32-bit index.
+
+    Block lock is the VM_BLOCK_FLAG_LOCKED bit of the flags. It is an exclusive
+    lock acquired with an interlocked bit test-and-set. Contended waiters set
+    VM_BLOCK_FLAG_WAITERS and sleep on one of the device's hashed wait events;
+    release signals the event only if someone is waiting. Since an event is
+    shared by many blocks, a waiter re-checks the lock on a short timeout in
+    case another waiter of the same event consumed the signal.
+
+    Physical blocks are also pinned by the requests accessing them; a pin is a
+    count in the flags, and any number of requests can pin a block. A pinned
+    block cannot be locked by others (eviction), and a locked block cannot be
+    pinned until it is released. A request can upgrade its pin to the lock if
+    it is the only one pinning the block (promotion).
 */
 
-typedef struct _VM_BLOCK_LOCK {
-    // This is a auto-reset event - synchronization event.
-    // If there are two threads blocked due to range locking
-    // this will still be deadlock free. Block operations are
-    // serialized
-    //
-    // Semantics:
-    // Initial state - Set
-    // Acquire - wait on event
-    // Release - set the event
-    //
-    KEVENT LockEvent;
+#define VM_BLOCK_FLAG_LOCKED_BIT    0
+#define VM_BLOCK_FLAG_LOCKED        (1 << VM_BLOCK_FLAG_LOCKED_BIT)
+#define VM_BLOCK_FLAG_WAITERS       (1 << 1)
+#define VM_BLOCK_FLAG_VALID         (1 << 2)
+#define VM_BLOCK_FLAG_ALLOCATED     (1 << 3)
+#define VM_BLOCK_FLAG_REFERENCED    (1 << 4)
+#define VM_BLOCK_FLAG_WRITTEN       (1 << 5)
+#define VM_BLOCK_FLAG_HASHED        (1 << 6)
+#define VM_BLOCK_FLAG_DEDUPLICATED  (1 << 7)
 
-    //
-    // Assist tracking ownership issues
-    //
-    PVOID OwnerThread;
-    PVOID ReturnAddress;
-}VM_BLOCK_LOCK, *PVM_BLOCK_LOCK;
+#define VM_BLOCK_TIER_SHIFT         8
+#define VM_BLOCK_TIER_MASK          (0xF << VM_BLOCK_TIER_SHIFT)
+
+#define VM_BLOCK_FLAG_COMPRESSED    (1 << 12)
+
+//
+// RAM tier block whose data saved by a clean shutdown is not loaded back yet;
+// the warm-up of the tier mover holds its block lock until it is
+//
+
+#define VM_BLOCK_FLAG_WARMING       (1 << 13)
+
+#define VM_BLOCK_PIN_SHIFT          16
+#define VM_BLOCK_PIN_UNIT           (1 << VM_BLOCK_PIN_SHIFT)
+#define VM_BLOCK_PIN_MASK           (0x7FFF << VM_BLOCK_PIN_SHIFT)
+#define VM_BLOCK_PIN_COUNT(_Flags_) (((_Flags_) & VM_BLOCK_PIN_MASK) >> VM_BLOCK_PIN_SHIFT)
+
+#define VM_BLOCK_TEST_FLAG(_Entry_, _Flag_) ((((_Entry_)->Flags) & (_Flag_)) != 0)
+#define VM_BLOCK_SET_FLAG(_Entry_, _Flag_) InterlockedOr(&((_Entry_)->Flags), (_Flag_))
+#define VM_BLOCK_CLEAR_FLAG(_Entry_, _Flag_) InterlockedAnd(&((_Entry_)->Flags), ~(_Flag_))
+
+//
+// Logical block whose data is moved by the I/O; an unmapped block and a block
+// deduplicated by the write have no data to move
+//
+
+#define VM_BLOCK_DATA_MOVED(_Entry_) \
+    ((((_Entry_)->Flags) & (VM_BLOCK_FLAG_VALID | VM_BLOCK_FLAG_DEDUPLICATED)) == VM_BLOCK_FLAG_VALID)
+
+#define VM_BLOCK_TIER(_Entry_) \
+    ((VIRTUAL_MINIPORT_TIER) ((((_Entry_)->Flags) & VM_BLOCK_TIER_MASK) >> VM_BLOCK_TIER_SHIFT))
+
+//
+// Tier is changed only by the owner of the block lock
+//
+
+#define VM_BLOCK_SET_TIER(_Entry_, _Tier_)                                      \
+    do {                                                                        \
+        VM_BLOCK_CLEAR_FLAG((_Entry_), VM_BLOCK_TIER_MASK);                     \
+        VM_BLOCK_SET_FLAG((_Entry_), ((LONG) (_Tier_)) << VM_BLOCK_TIER_SHIFT); \
+    } while ( 0 )
+
+#define VIRTUAL_MINIPORT_BLOCK_LOCK_WAIT_EVENTS 64
+#define VM_BLOCK_LOCK_WAIT_TIMEOUT (-10000LL)   // 1ms, relative
+
+#define VM_BLOCK_LOCK_WAIT_EVENT(_Device_, _Flags_) \
+    (&((_Device_)->BlockLockWaitEvents [(((ULONG_PTR) (_Flags_)) >> 2) % VIRTUAL_MINIPORT_BLOCK_LOCK_WAIT_EVENTS]))
+
+//
+// Physical blocks are referred to by their index in PhysicalBlocks. Index
+// terminates the free lists and victim chains, and marks unmapped blocks.
+//
+
+#define VM_DEVICE_INVALID_BLOCK_INDEX MAXULONG
+
+#define VM_DEVICE_PHYSICAL_BLOCK_ENTRY(_Device_, _PhysicalBlockIndex_) \
+    (&((PVIRTUAL_MINIPORT_PHYSICAL_BLOCK_ENTRY) (_Device_)->PhysicalBlocks) [(_PhysicalBlockIndex_)])
+
+//
+// RAM tier blocks are addressed in memory by (segment, offset), file tier
+// blocks by offset in the file tier; a level of the file tier is a file of
+// its own, at the offset of its first block. RAM tier blocks are contiguous
+// only within a segment, file tier blocks only within a level.
+//
+
+#define VM_DEVICE_RAM_SEGMENT_START(_Device_, _TierBlockNumber_) \
+    (((_TierBlockNumber_) & (_Device_)->PhysicalMemorySegmentMask) == 0)
 
-#define VM_DEVICE_PHYSICAL_BLOCK_NUMBER(_Device_, _PhysicalBlockAddress_) (ULONGLONG)(((PUCHAR)_PhysicalBlockAddress_)-((PUCHAR)(_Device_->PhysicalBlocks))/sizeof(VIRTUAL_MINIPORT_PHYSICAL_BLOCK_ENTRY))
-#define VM_DEVICE_PHYSICAL_BLOCK_ENTRY(_Device_, _PhysicalBlockNumber_) &(_Device_->PhysicalBlocks[_PhysicalBlockNumber_])
+#define VM_DEVICE_TIER_BLOCK_ADDRESS(_Device_, _Tier_, _TierBlockNumber_)                                          \
+    (((_Tier_) == VMTierPhysicalMemory) ?                                                                          \
+     (PVOID) ((PUCHAR) (_Device_)->PhysicalMemorySegments [(_TierBlockNumber_) >> (_Device_)->PhysicalMemorySegmentShift] + \
+              ((ULONG_PTR) ((_TierBlockNumber_) & (_Device_)->PhysicalMemorySegmentMask) * (_Device_)->BlockSize)) : \
+     (PVOID) ((ULONG_PTR) (_TierBlockNumber_) * (_Device_)->BlockSize))
 
 /*++
     Represents the logical block entry
@@ -80,18 +161,18 @@ typedef struct _VM_BLOCK_LOCK {
 
 typedef struct _VIRTUAL_MINIPORT_LOGICAL_BLOCK_ENTRY {
     //
-    // Once allocated to a physical block number, this mapping
-    // will never change
+    // Block lock and VM_BLOCK_FLAG_VALID. Access to the block is serialized
+    // by the range lock of the logical device; block lock only serializes
+    // the mapping of the block. VM_BLOCK_FLAG_DEDUPLICATED is set by a write
+    // that mapped the block to a block holding its data already, until the
+    // write releases the range lock.
     //
-    PVOID PhysicalBlockAddress;
+    volatile LONG Flags;
 
     //
-    // Any thread that attempts an access to this block
-    // will have to wait on the acquire this lock and then
-    // proceed.
+    // Once allocated to a physical block, this mapping will never change
     //
-    VM_BLOCK_LOCK Lock;
-    BOOLEAN Valid;
+    ULONG PhysicalBlockIndex;
 }VIRTUAL_MINIPORT_LOGICAL_BLOCK_ENTRY, *PVIRTUAL_MINIPORT_LOGICAL_BLOCK_ENTRY;
 
 /*++
@@ -99,32 +180,494 @@ typedef struct _VIRTUAL_MINIPORT_LOGICAL_BLOCK_ENTRY {
 --*/
 
 typedef struct _VIRTUAL_MINIPORT_PHYSICAL_BLOCK_ENTRY {
-    
     //
-    // List is meaningful when the 
-    // - block entry is free
-    // - bock entry translates to LRU tier
-    //   
-    LIST_ENTRY List;
+    // Block lock, pin count, the tier and
+    // - VM_BLOCK_FLAG_VALID - Entry is backed by a tier block
+    // - VM_BLOCK_FLAG_ALLOCATED - Set once the block is mapped to a logical block
+    // - VM_BLOCK_FLAG_REFERENCED - CLOCK reference bit; set on every access
+    //   without any lock, cleared by the CLOCK hand
+    // - VM_BLOCK_FLAG_WRITTEN - Block has been written since it was mapped. A
+    //   block never written reads as zeros, whatever its tier block holds; it
+    //   is not read from the file tier, and is not written to it on eviction.
+    //   Tiers are exclusive, so a RAM tier block has no file tier copy; a
+    //   written block is always dirty, and a block never written is clean.
+    // - VM_BLOCK_FLAG_HASHED - Block is in the deduplication index; its data
+    //   does not change until it is freed
+    // - VM_BLOCK_FLAG_COMPRESSED - Block has a compressed copy of its data in
+    //   the compressed tier. A file tier block reads from the copy and not
+    //   from the file; its file offset may hold stale data. A RAM tier block
+    //   has one only while it is being demoted.
+    //
+    volatile LONG Flags;
 
     //
-    // Tier Block number
+    // Block number within the tier
     //
-    PVOID TierBlockAddress;
+    ULONG TierBlockNumber;
 
     //
-    // Any thread that attempts an access to this block
-    // will have to wait on the acquire this lock and then
-    // proceed.
+    // Next is meaningful when the
+    // - block entry is free
+    // - block entry is picked as a victim
+    // - block entry is locked by the tier mover to be promoted
     //
-    VM_BLOCK_LOCK Lock;
-    BOOLEAN Valid;
-    VIRTUAL_MINIPORT_TIER Tier;
+    ULONG Next;
 }VIRTUAL_MINIPORT_PHYSICAL_BLOCK_ENTRY, *PVIRTUAL_MINIPORT_PHYSICAL_BLOCK_ENTRY;
 
 
+/*++
+    Represents the deduplication state of a physical block. Blocks of a
+    deduplicated device are indexed by the hash of their data, in hash chains
+    linked through Next; a block is shared by all the logical blocks written
+    with its data. A shared block is never written; a logical block written
+    with new data is mapped afresh (copy-on-write), and the new block is
+    indexed once the write is done.
+
+    References are taken under the shared lock of the hash bucket, and the
+    chains are changed under the exclusive one. Last reference is dropped
+    under the block lock too, so that a block being freed cannot be found.
+--*/
+
+#define VIRTUAL_MINIPORT_DEDUP_LOCKS 64
+#define VIRTUAL_MINIPORT_DEDUP_CHAIN_LENGTH 4  // Blocks per hash bucket
+
+typedef struct _VIRTUAL_MINIPORT_DEDUP_ENTRY {
+    ULONG Hash;
+    ULONG Next;
+    volatile LONG References;                  // Logical blocks mapped to the block
+}VIRTUAL_MINIPORT_DEDUP_ENTRY, *PVIRTUAL_MINIPORT_DEDUP_ENTRY;
+
+#define VM_DEVICE_DEDUP_ENTRY(_Device_, _PhysicalBlockIndex_) \
+    (&((_Device_)->DedupEntries [(_PhysicalBlockIndex_)]))
+
+#define VM_DEVICE_DEDUP_BUCKET(_Device_, _Hash_) \
+    ((_Hash_) & (_Device_)->DedupBucketMask)
+
+#define VM_DEVICE_DEDUP_LOCK(_Device_, _Hash_) \
+    (&((_Device_)->DedupLocks [VM_DEVICE_DEDUP_BUCKET((_Device_), (_Hash_)) % VIRTUAL_MINIPORT_DEDUP_LOCKS]))
+
+/*++
+    Represents a compressed copy of the data of a physical block. Compressed
+    tier is carved into slabs; objects of a slab are all of a size class, a
+    multiple of an eighth of the block. Data that does not compress to six
+    eighths of the block is not worth keeping compressed, and is written to
+    the file tier.
+
+    Objects are referred to by (slab, offset in the slab). An object is owned
+    by the physical block holding it, and is freed by the owner of the block
+    lock; or of the pin, if it is the only logical block mapping the block and
+    holds its exclusive range lock. Slab lists are changed under CompressedLock.
+--*/
+
+#define VIRTUAL_MINIPORT_COMPRESSED_SLAB_SIZE (0x10000UL)
+#define VIRTUAL_MINIPORT_COMPRESSED_SLAB_SHIFT 16
+#define VIRTUAL_MINIPORT_COMPRESSED_MAX_SLABS (0x10000UL)
+#define VIRTUAL_MINIPORT_COMPRESSED_CLASSES 6
+
+//
+// Tier mover writes the compressed blocks back to the file tier once the
+// free slabs are down to the low watermark, until they are up to the high
+// watermark again. Unit: Percent of the slabs.
+//
+
+#define VIRTUAL_MINIPORT_COMPRESSED_LOW_WATERMARK 5
+#define VIRTUAL_MINIPORT_COMPRESSED_HIGH_WATERMARK 10
+
+#define VM_DEVICE_INVALID_COMPRESSED_OBJECT MAXULONG
+
+typedef struct _VIRTUAL_MINIPORT_COMPRESSED_OBJECT {
+    ULONG Owner;                               // Physical block; invalid if the object is free
+    union {
+        ULONG Length;                          // Bytes of compressed data
+        ULONG NextFree;                        // Next free object of the slab
+    };
+    UCHAR Data [1];
+}VIRTUAL_MINIPORT_COMPRESSED_OBJECT, *PVIRTUAL_MINIPORT_COMPRESSED_OBJECT;
+
+typedef struct _VIRTUAL_MINIPORT_COMPRESSED_SLAB {
+    LIST_ENTRY List;                           // Free slabs, or partial slabs of the class
+    PVOID Memory;
+    ULONG Class;                               // VIRTUAL_MINIPORT_COMPRESSED_CLASSES if free
+    ULONG ObjectSize;                          // Bytes, with the object header
+    ULONG ObjectCount;
+    ULONG FreeCount;
+    ULONG FreeObject;                          // Offset of the first free object
+}VIRTUAL_MINIPORT_COMPRESSED_SLAB, *PVIRTUAL_MINIPORT_COMPRESSED_SLAB;
+
+#define VM_DEVICE_COMPRESSED_OBJECT(_Device_, _Object_)                                              \
+    ((PVIRTUAL_MINIPORT_COMPRESSED_OBJECT)                                                            \
+     ((PUCHAR) (_Device_)->CompressedSlabs [(_Object_) >> VIRTUAL_MINIPORT_COMPRESSED_SLAB_SHIFT].Memory + \
+      ((_Object_) & (VIRTUAL_MINIPORT_COMPRESSED_SLAB_SIZE - 1))))
+
+/*++
+    Represents an extent; a run of logical blocks whose physical blocks are
+    in the same tier and are contiguous in that tier. An extent is moved with
+    a single copy (RAM tier) or a single file I/O (File tier).
+--*/
+
+//
+// Largest extent moved with a single copy or file I/O
+//
+
+#define VIRTUAL_MINIPORT_MAX_EXTENT_SIZE (0x00040000UL)
+
+//
+// Largest read/write moved inline at the IRQL of the caller, by
+// VMDeviceTryReadWriteLogicalDevice; bounded both in bytes and in blocks
+//
+
+#define VIRTUAL_MINIPORT_FAST_IO_MAX_SIZE (0x00010000UL)
+#define VIRTUAL_MINIPORT_FAST_IO_MAX_BLOCKS 16
+
+typedef struct _VIRTUAL_MINIPORT_EXTENT {
+    VIRTUAL_MINIPORT_TIER Tier;
+    ULONG TierBlockNumber;      // Tier block number of the first block of the extent
+    ULONG BlockCount;
+
+    //
+    // RAM tier blocks taken to promote a file tier extent; free blocks taken
+    // off the free lists, and blocks picked by the CLOCK hand. Victims are
+    // chained through their Next and are owned by us; picked ones are locked.
+    //
+    ULONG VictimCount;
+    ULONG Victims;
+
+    //
+    // File tier extent whose blocks are all in the compressed tier, or none
+    //
+    BOOLEAN Compressed;
+}VIRTUAL_MINIPORT_EXTENT, *PVIRTUAL_MINIPORT_EXTENT;
+
 #define GUID_STRING_LENGTH sizeof(L"xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx")
 
+/*++
+    Represents a shard of the device. Physical block space is split into shards,
+    each with its own free lists, CLOCK state and lock so that allocation and
+    eviction from different CPUs do not serialize on a single lock.
+
+    A shard owns a fixed range of RAM frames and the free blocks of the tier
+    block ranges it owns; of every level of the file tier. A free block is
+    always returned to the shard owning its tier block, which changes as the
+    block moves between the tiers.
+--*/
+
+#define VIRTUAL_MINIPORT_MAX_DEVICE_SHARDS 64
+
+typedef struct _VIRTUAL_MINIPORT_DEVICE_SHARD {
+    VM_LOCK ShardLock;
+
+    ULONGLONG PhysicalMemoryFreeEntries;
+    ULONGLONG FileTierFreeEntries [VIRTUAL_MINIPORT_MAX_FILE_TIERS];
+    ULONG PhysicalMemoryFreeHead;
+    ULONG FileTierFreeHead [VIRTUAL_MINIPORT_MAX_FILE_TIERS];
+
+    //
+    // RAM frames [FirstFrame, FirstFrame + FrameCount) are swept by the
+    // shard's CLOCK hand. Hand is relative to FirstFrame.
+    //
+    ULONGLONG PhysicalMemoryFirstFrame;
+    ULONGLONG PhysicalMemoryFrameCount;
+    ULONGLONG PhysicalMemoryClockHand;
+}VIRTUAL_MINIPORT_DEVICE_SHARD, *PVIRTUAL_MINIPORT_DEVICE_SHARD;
+
+//
+// Shard owning the block at _BlockIndex_ of a tier of _MaxBlocks_ blocks; tier
+// blocks are split into contiguous ranges of (about) the same size
+//
+
+#define VM_DEVICE_BLOCK_SHARD(_BlockIndex_, _MaxBlocks_, _ShardCount_) \
+    ((ULONG) (((ULONGLONG) (_BlockIndex_) * (_ShardCount_)) / (_MaxBlocks_)))
+
+/*++
+    Represents a level of the file tier; a backing file of its own, on a
+    volume of its own. Tier block numbers of the file tier run through the
+    levels in order, the fastest first.
+
+    Victims of the RAM tier are demoted to the fastest level with free blocks.
+    Tier mover keeps the free blocks of a level between its watermarks by
+    demoting the blocks of the level not referenced since its CLOCK hand
+    passed them last to the levels below; the hand sweeps the physical block
+    entries. A block of any level is promoted to the RAM tier when it is
+    accessed. The last level has no watermarks.
+
+    First level also holds the RAM tier saved by a clean shutdown, past its
+    blocks, and names the map file.
+--*/
+
+typedef struct _VIRTUAL_MINIPORT_FILE_TIER {
+    UNICODE_STRING FileName;
+    HANDLE File;
+    PFILE_OBJECT FileObject;               // Referenced for asynchronous I/O
+    ULONGLONG FirstBlock;                  // Tier block number of its first block
+    ULONGLONG MaxBlocks;
+    ULONGLONG FreeLowWatermark;            // Blocks
+    ULONGLONG FreeHighWatermark;           // Blocks
+    ULONG ClockHand;                       // Physical block entry swept next
+}VIRTUAL_MINIPORT_FILE_TIER, *PVIRTUAL_MINIPORT_FILE_TIER;
+
+//
+// Shard owning the file tier block of the level; the blocks of every level
+// are split across all the shards
+//
+
+#define VM_DEVICE_FILE_TIER_SHARD(_Device_, _Level_, _TierBlockNumber_)                  \
+    VM_DEVICE_BLOCK_SHARD((_TierBlockNumber_) - (_Device_)->FileTiers [(_Level_)].FirstBlock, \
+                          (_Device_)->FileTiers [(_Level_)].MaxBlocks,                    \
+                          (_Device_)->ShardCount)
+
+//
+// Shard allocations and evictions start at; one per CPU
+//
+
+#define VM_DEVICE_HOME_SHARD(_Device_) \
+    (KeGetCurrentProcessorNumberEx(NULL) % (_Device_)->ShardCount)
+
+//
+// Tier mover checks the free RAM tier blocks at least this often, even if it
+// is not woken up
+//
+
+#define VM_DEVICE_TIER_MOVER_INTERVAL (-1000000LL)  // 100ms, relative
+
+/*++
+    Represents a prefetch queued to the tier mover; Steps runs of BlockCount
+    logical blocks, Stride blocks apart, starting at LogicalBlockNumber. The
+    prefetch holds the rundown reference of the logical device until the tier
+    mover is done with it.
+--*/
+
+#define VIRTUAL_MINIPORT_PREFETCH_QUEUE_DEPTH 32
+
+typedef struct _VIRTUAL_MINIPORT_PREFETCH {
+    struct _VIRTUAL_MINIPORT_LOGICAL_DEVICE *LogicalDevice;
+    ULONGLONG LogicalBlockNumber;
+    ULONG BlockCount;
+    ULONG Stride;
+    ULONG Steps;
+}VIRTUAL_MINIPORT_PREFETCH, *PVIRTUAL_MINIPORT_PREFETCH;
+
+/*++
+    Represents the persistent map of a device with a file tier; the physical
+    block entries and the logical block maps, kept in a map file next to the
+    backing file of the file tier. Map file holds
+
+    - Two headers; the valid one written last is current. It refers to the
+      current checkpoint.
+    - Journal; the changes since the current checkpoint, in batches of records
+      appended by the group commits. Replay stops at the first batch that is
+      not valid, or is not of the current checkpoint.
+    - Checkpoints; a checkpoint is written where it does not overlap the
+      current one, which is intact until the header refers to the new one.
+
+    A record sets the state of an entry, and does not change it; a checkpoint
+    scanned while the entries change is made consistent by replaying the
+    records logged since its scan started.
+
+    Data of the file tier blocks is flushed before the records referring to
+    it are written. RAM tier and the compressed tier are volatile; a clean
+    shutdown writes the compressed blocks back to the file tier, saves the RAM
+    tier past the file tier blocks in the backing file, and marks the map
+    clean. After a crash, the blocks that were in either read as zeros.
+
+    RAM tier is saved and loaded back in chunks; only the chunks holding
+    written blocks are saved, and the checkpoint of a clean shutdown ranks
+    them by the blocks referenced since the CLOCK hand passed them last. When
+    the device is created again, the tier mover loads the chunks back hottest
+    first, a few reads in flight, while the device is already in use; an I/O
+    to a chunk not loaded yet has its chunk loaded next.
+--*/
+
+#define VIRTUAL_MINIPORT_MAP_SIGNATURE 'pMMV'
+#define VIRTUAL_MINIPORT_MAP_BATCH_SIGNATURE 'bMMV'
+#define VIRTUAL_MINIPORT_MAP_VERSION 4
+
+#define VIRTUAL_MINIPORT_MAP_SECTOR_SIZE 512
+#define VIRTUAL_MINIPORT_MAP_HEADER_SIZE (0x1000UL)
+#define VIRTUAL_MINIPORT_MAP_JOURNAL_OFFSET (2 * VIRTUAL_MINIPORT_MAP_HEADER_SIZE)
+#define VIRTUAL_MINIPORT_MAP_MIN_JOURNAL_SIZE (0x1000000ULL)   // 16MB
+#define VIRTUAL_MINIPORT_MAP_MAX_SLOTS 256                     // Logical devices
+#define VIRTUAL_MINIPORT_MAP_RESTORE_PERIOD (6000000000ULL)    // 10 minutes; restored maps are claimed within
+
+//
+// Records are appended to the active one of two buffers; a group commit
+// writes it out as a batch while records go to the other one. Tier mover is
+// woken up to commit once the active buffer is half full.
+//
+
+#define VIRTUAL_MINIPORT_JOURNAL_BUFFER_SIZE (0x100000UL)
+
+typedef struct _VIRTUAL_MINIPORT_MAP_HEADER {
+    ULONG Signature;
+    ULONG Version;
+    ULONGLONG Update;                          // Bumped by every header write
+    ULONGLONG Generation;                      // Bumped by every checkpoint
+    ULONG BlockSize;
+    BOOLEAN Deduplication;
+    BOOLEAN Clean;                             // RAM tier is saved in the backing file
+    ULONGLONG PhysicalMemoryTierMaxBlocks;
+    ULONGLONG FileTierMaxBlocks;
+    ULONG FileTierCount;
+    ULONGLONG FileTierBlocks [VIRTUAL_MINIPORT_MAX_FILE_TIERS];
+    ULONGLONG JournalSize;                     // Bytes
+    ULONGLONG CheckpointOffset;
+    ULONGLONG CheckpointLength;
+    ULONG CheckpointChecksum;
+    ULONG Checksum;                            // Of the header up to here
+}VIRTUAL_MINIPORT_MAP_HEADER, *PVIRTUAL_MINIPORT_MAP_HEADER;
+
+//
+// Checkpoint is
+// - A VIRTUAL_MINIPORT_MAP_BLOCK per physical block entry
+// - Count of the logical device maps, then the maps. A map is a
+//   VIRTUAL_MINIPORT_MAP_SLOT_HEADER, and the physical block index of every
+//   logical block, or VM_DEVICE_INVALID_BLOCK_INDEX if it is not mapped.
+// - Count of the RAM tier chunks saved, then the chunks, hottest first; none
+//   unless the checkpoint is of a clean shutdown
+//
+
+typedef struct _VIRTUAL_MINIPORT_MAP_BLOCK {
+    ULONG Flags;                               // Tier, VM_BLOCK_FLAG_WRITTEN and VM_BLOCK_FLAG_COMPRESSED
+    ULONG TierBlockNumber;
+}VIRTUAL_MINIPORT_MAP_BLOCK, *PVIRTUAL_MINIPORT_MAP_BLOCK;
+
+#define VM_MAP_BLOCK_FLAGS (VM_BLOCK_TIER_MASK | VM_BLOCK_FLAG_WRITTEN | VM_BLOCK_FLAG_COMPRESSED)
+
+//
+// RAM tier is saved and loaded back in chunks of this size, ranked in this
+// many ranks; a few chunks are read in flight at a time
+//
+
+#define VIRTUAL_MINIPORT_WARM_CHUNK_SIZE (0x100000UL)
+#define VIRTUAL_MINIPORT_WARM_RANKS 8
+#define VIRTUAL_MINIPORT_WARM_QUEUE_DEPTH 4
+
+typedef struct _VIRTUAL_MINIPORT_MAP_SLOT_HEADER {
+    ULONG Slot;
+    ULONG ThinProvision;
+    ULONGLONG MaxBlocks;
+    ULONG Lun;                                 // Of the logical device, on the device
+    ULONG Reserved;
+}VIRTUAL_MINIPORT_MAP_SLOT_HEADER, *PVIRTUAL_MINIPORT_MAP_SLOT_HEADER;
+
+//
+// Journal batch is a VIRTUAL_MINIPORT_MAP_BATCH and its records, padded to
+// the sector size
+//
+
+typedef struct _VIRTUAL_MINIPORT_MAP_BATCH {
+    ULONG Signature;
+    ULONG RecordCount;
+    ULONGLONG Generation;                      // Of the checkpoint the batch follows
+    ULONGLONG Sequence;                        // Of the batch since the checkpoint
+    ULONG Checksum;                            // Of the records
+    ULONG Reserved;
+}VIRTUAL_MINIPORT_MAP_BATCH, *PVIRTUAL_MINIPORT_MAP_BATCH;
+
+typedef enum _VIRTUAL_MINIPORT_MAP_RECORD_TYPE {
+    VMMapRecordPhysicalBlock = 1,              // Index - Physical block; Value - Flags << 32 | TierBlockNumber
+    VMMapRecordLogicalBlock,                   // Slot; Index - Physical block or invalid; Value - Logical block
+    VMMapRecordCreateSlot,                     // Slot; Index - Lun << 16 | Thin provisioned; Value - Block count
+    VMMapRecordDeleteSlot                      // Slot
+}VIRTUAL_MINIPORT_MAP_RECORD_TYPE, *PVIRTUAL_MINIPORT_MAP_RECORD_TYPE;
+
+typedef struct _VIRTUAL_MINIPORT_MAP_RECORD {
+    USHORT Type;
+    USHORT Slot;
+    ULONG Index;
+    ULONGLONG Value;
+}VIRTUAL_MINIPORT_MAP_RECORD, *PVIRTUAL_MINIPORT_MAP_RECORD;
+
+/*++
+    Represents a logical device map of the persistent map. A live slot is the
+    map of a logical device. A restored slot is a map replayed at the device
+    creation that no logical device has attached to yet; it keeps its blocks
+    mapped until the logical device of its Lun attaches to it. Map of a Lun
+    created again with another geometry, or not created again within
+    VIRTUAL_MINIPORT_MAP_RESTORE_PERIOD, is released along with its blocks.
+--*/
+
+typedef enum _VIRTUAL_MINIPORT_MAP_SLOT_STATE {
+    VMMapSlotFree,
+    VMMapSlotLive,
+    VMMapSlotRestored
+}VIRTUAL_MINIPORT_MAP_SLOT_STATE, *PVIRTUAL_MINIPORT_MAP_SLOT_STATE;
+
+typedef struct _VIRTUAL_MINIPORT_MAP_SLOT {
+    VIRTUAL_MINIPORT_MAP_SLOT_STATE State;
+    ULONG Lun;
+    BOOLEAN ThinProvision;
+    ULONGLONG MaxBlocks;
+    PULONG Blocks;                             // Restored; physical block of every logical block
+    struct _VIRTUAL_MINIPORT_LOGICAL_DEVICE *LogicalDevice;    // Live
+}VIRTUAL_MINIPORT_MAP_SLOT, *PVIRTUAL_MINIPORT_MAP_SLOT;
+
+typedef struct _VIRTUAL_MINIPORT_JOURNAL {
+    PVOID AdapterExtension;                    // Needed to free stor allocations
+    UNICODE_STRING MapFileName;
+    HANDLE MapFile;                            // NULL - Device is not persistent
+
+    //
+    // State of the map file; changed under CommitLock
+    //
+    VM_LOCK CommitLock;
+    ULONGLONG Update;
+    ULONGLONG Generation;
+    ULONGLONG Sequence;                        // Of the next batch
+    ULONGLONG JournalSize;                     // Bytes
+    ULONGLONG JournalOffset;                   // Of the next batch, in the journal
+    ULONGLONG CheckpointOffset;
+    ULONGLONG CheckpointLength;
+    ULONG CheckpointChecksum;
+    BOOLEAN Clean;                             // Header on the map file is clean
+    volatile BOOLEAN Dirty;                    // Written since the last clean checkpoint
+
+    //
+    // Records logged since the last commit; appended under BufferLock
+    //
+    VM_LOCK BufferLock;
+    PUCHAR Buffers [2];
+    ULONG ActiveBuffer;
+    ULONG BufferUsed;                          // Bytes of the active buffer, with the batch header
+    BOOLEAN Overflow;                          // Records were dropped; next commit writes a checkpoint
+
+    //
+    // Logical device maps; changed under DeviceLock
+    //
+    VIRTUAL_MINIPORT_MAP_SLOT Slots [VIRTUAL_MINIPORT_MAP_MAX_SLOTS];
+
+    //
+    // Outcome of the replay at the device creation
+    //
+    BOOLEAN Restored;
+    BOOLEAN RestoredClean;
+    ULONGLONG LostBlocks;                      // Written blocks lost by a crash
+    ULONGLONG RestoreDeadline;                 // Interrupt time restored slots are released at; 0 once done
+
+    //
+    // Chunks of the RAM tier saved by a clean shutdown, hottest first. State
+    // of a chunk is its rank while the RAM tier is saved, and non-zero until
+    // it is loaded while the RAM tier is loaded back.
+    //
+    ULONG WarmChunkBlocks;                     // RAM tier blocks per chunk
+    ULONG WarmChunkTotal;                      // Chunks of the RAM tier
+    ULONG WarmChunkCount;                      // Chunks saved
+    PULONG WarmChunks;
+    PUCHAR WarmChunkState;
+}VIRTUAL_MINIPORT_JOURNAL, *PVIRTUAL_MINIPORT_JOURNAL;
+
+/*++
+    Represents a read in flight of the warm-up, loading a chunk of the RAM
+    tier saved by a clean shutdown
+--*/
+
+typedef struct _VIRTUAL_MINIPORT_WARM_READ {
+    VIRTUAL_MINIPORT_FILE_IO FileIo;
+    KEVENT Done;
+    NTSTATUS Status;
+    ULONG Chunk;
+    PUCHAR Buffer;
+}VIRTUAL_MINIPORT_WARM_READ, *PVIRTUAL_MINIPORT_WARM_READ;
+
 /*++
     Represents the device
 --*/
@@ -132,13 +675,39 @@ typedef struct _VIRTUAL_MINIPORT_PHYSICAL_BLOCK_ENTRY {
 typedef struct _VIRTUAL_MINIPORT_TIERED_DEVICE {
     VM_LOCK DeviceLock;
     ULONGLONG Size;                        // Bytes
-    ULONGLONG AllocatedSize;               // Bytes
-    VIRTUAL_MINIPORT_BLOCK_SIZE BlockSize; // Bytes
+    ULONGLONG AllocatedSize;               // Bytes; thin logical devices may overcommit
+
+    //
+    // Blocks committed to the logical devices; all the blocks of a thick one,
+    // and the mapped blocks of a thin one
+    //
+    volatile LONG64 CommittedBlocks;
+
+    //
+    // Logical blocks mapped, and the physical blocks holding them; these
+    // differ by the blocks deduplicated
+    //
+    volatile LONG64 MappedBlocks;
+    volatile LONG64 AllocatedBlocks;
+
+    //
+    // Blocks are allocation units; mapped, locked and moved between the
+    // tiers as a whole. Luns address sectors within them.
+    //
+    ULONG BlockSize;                       // Bytes; allocation unit
+    VIRTUAL_MINIPORT_BLOCK_SIZE SectorSize; // Bytes
     ULONGLONG MaxBlocks;
 
     ULONG LogicalDeviceCount;
     LIST_ENTRY LogicalDevices;             // List of all logical devices
 
+    //
+    // Identity of the device; names its backing file and map file, so that a
+    // device created again with it restores its blocks
+    //
+    GUID DeviceId;
+    VIRTUAL_MINIPORT_JOURNAL Journal;
+
     ULONG TierCount;
 
     //
@@ -146,15 +715,24 @@ typedef struct _VIRTUAL_MINIPORT_TIERED_DEVICE {
     //
     ULONGLONG PhysicalMemoryTierSize;
     ULONGLONG PhysicalMemoryTierMaxBlocks;
-    PVOID PhysicalMemoryTier;
 
     //
-    // File Tier description
+    // RAM tier arena. Segment of a RAM tier block is its block number shifted
+    // right by SegmentShift, and the block within the segment is masked by
+    // SegmentMask.
+    //
+    ULONG PhysicalMemorySegmentCount;
+    ULONG PhysicalMemorySegmentShift;
+    ULONG PhysicalMemorySegmentMask;
+    PVOID *PhysicalMemorySegments;
+
+    //
+    // File Tier description; all of its levels
     //
-    UNICODE_STRING FileTierFileName;
-    HANDLE FileTier;
     ULONGLONG FileTierSize;
     ULONGLONG FileTierMaxBlocks;
+    ULONG FileTierCount;
+    VIRTUAL_MINIPORT_FILE_TIER FileTiers [VIRTUAL_MINIPORT_MAX_FILE_TIERS];
 
     //
     // Physical blocks are needed to normalize the multiple logical device
@@ -164,31 +742,180 @@ typedef struct _VIRTUAL_MINIPORT_TIERED_DEVICE {
 
     //
     // - All block allocations starts at Physical memory FreeList
-    // - Allocated blocks move to physical memory LRU list
-    // - If the physical memory tier is full,
-    //  - Pick an entry from the FileTier Free List
-    //  - Block allocations will pick an LRU entry from physical memory tier
-    //  - Moves the contents from Physical memory LRU entry to File tier entry from free list
-    // - Allocates the free block to new block allocation request
+    // - If the physical memory tier is full, allocations come from the FileTier Free List
     //
     // - If the block being requested is in file tier
-    //  - Find an LRU entry from physical memory tier
+    //  - Pick a victim from physical memory tier with the CLOCK hand
     //  - swap the physical memory block and the file tier block
     //
 
-    // Since we dont support thin provisioning we will always be able to satisfy the requests
-    // and if the tiered device cannot hold more logical devices, we fail at the logical device
-    // creation.
+    // Thick provisioned logical devices commit all their blocks at creation, so their
+    // requests are always satisfied, and creation fails if the tiered device cannot hold
+    // them. Thin provisioned ones commit a block when it is first mapped, and a write
+    // fails with STATUS_DISK_FULL if none is left; see CommittedBlocks.
+    //
+    // Free lists and CLOCK state live in the shards. DeviceLock protects the
+    // logical device list and accounting only.
+    //
+    ULONG ShardCount;
+    PVIRTUAL_MINIPORT_DEVICE_SHARD Shards;
 
-    ULONGLONG PhysicalMemoryFreeEntries;
-    ULONGLONG FileTierFreeEntries;
-    LIST_ENTRY PhysicalMemoryFreeList;
-    LIST_ENTRY FileTierFreeList;
+    //
+    // CLOCK replacement for the RAM tier. Frames maps a RAM tier block number
+    // to the index of the physical block entry holding it. A frame is swept
+    // only by the hand of the shard owning it, under ShardLock.
+    //
+    PULONG PhysicalMemoryFrames;
+
+    //
+    // Compressed tier; a compressed object per physical block, and the slabs
+    // holding them. Tier mover writes the compressed blocks back to the file
+    // tier in slab order; the hand is the offset of the next object, and a
+    // block read since it was passed last is passed again.
+    //
+    ULONGLONG CompressedTierSize;          // Bytes
+    ULONG CompressedSlabCount;
+    PVIRTUAL_MINIPORT_COMPRESSED_SLAB CompressedSlabs;
+    PULONG CompressedObjects;
+    VM_LOCK CompressedLock;
+    LIST_ENTRY CompressedFreeSlabs;
+    LIST_ENTRY CompressedPartialSlabs [VIRTUAL_MINIPORT_COMPRESSED_CLASSES];
+    ULONG CompressedFreeSlabCount;
+    ULONG CompressedLowWatermark;          // Slabs
+    ULONG CompressedHighWatermark;         // Slabs
+    ULONG CompressedHand;
+    volatile LONG64 CompressedBlocks;
+    volatile LONG64 CompressedBytes;
+
+    //
+    // Deduplication index; a dedup entry per physical block, and the hash
+    // buckets heading the chains. Bucket locks are striped.
+    //
+    BOOLEAN Deduplication;
+    PVIRTUAL_MINIPORT_DEDUP_ENTRY DedupEntries;
+    PULONG DedupBuckets;
+    ULONG DedupBucketMask;
+    VM_LOCK DedupLocks [VIRTUAL_MINIPORT_DEDUP_LOCKS];
+
+    //
+    // Hashed wait events of the block locks
+    //
+    KEVENT BlockLockWaitEvents [VIRTUAL_MINIPORT_BLOCK_LOCK_WAIT_EVENTS];
 
-    ULONGLONG PhysicalMemoryLruEntries;
-    LIST_ENTRY PhysicalMemoryLruList;
+    //
+    // Tier mover keeps the free RAM tier blocks between the watermarks, by
+    // demoting the victims to free file tier blocks ahead of demand. Then a
+    // promotion takes the free RAM tier blocks, and pays only for its read.
+    // ReservedSize is held back from the logical devices, so that there are
+    // always free file tier blocks to demote to.
+    //
+    ULONGLONG FreeMemoryLowWatermark;      // Blocks
+    ULONGLONG FreeMemoryHighWatermark;     // Blocks
+    ULONGLONG ReservedSize;                // Bytes
+    PETHREAD TierMover;
+    KEVENT TierMoverEvent;
+    volatile BOOLEAN TierMoverStop;
+    PVOID TierMoverBuffer;                 // Staging buffer of the tier mover
+
+    //
+    // Shutdown flush of the device is run by the tier mover, which owns the
+    // staging buffer; flushes are serialized by FlushLock, and a flush waits
+    // on FlushDone for the tier mover.
+    //
+    VM_LOCK FlushLock;
+    KEVENT FlushDone;
+    volatile BOOLEAN FlushRequested;
+    NTSTATUS FlushStatus;
+
+    //
+    // Warm-up of the RAM tier saved by a clean shutdown, run by the tier
+    // mover before anything else. An I/O finding a block not loaded yet sets
+    // WarmDemandChunk, and the chunk is read next.
+    //
+    PVOID WarmBuffer;                      // VIRTUAL_MINIPORT_WARM_QUEUE_DEPTH chunks
+    volatile LONG WarmDemandChunk;         // -1 - None
+    volatile LONG64 WarmBlocks;            // Blocks not loaded yet
+
+    //
+    // Tier mover also promotes the blocks the read streams of the logical
+    // devices are expected to read next, into free RAM tier blocks. Prefetches
+    // are dropped when the queue is full.
+    //
+    ULONG PrefetchDepthMin;                // Blocks
+    ULONG PrefetchDepthMax;                // Blocks; 0 - No prefetch
+    VM_LOCK PrefetchQueueLock;
+    ULONG PrefetchQueueHead;
+    ULONG PrefetchQueueCount;
+    VIRTUAL_MINIPORT_PREFETCH PrefetchQueue [VIRTUAL_MINIPORT_PREFETCH_QUEUE_DEPTH];
 }VIRTUAL_MINIPORT_TIERED_DEVICE, *PVIRTUAL_MINIPORT_TIERED_DEVICE;
 
+/*++
+    Represents a range lock on the logical blocks [Start, End) of a logical
+    device; shared for reads and exclusive for writes. Range locks are granted
+    in arrival order; a range lock waits for all the earlier overlapping ones,
+    unless both are shared. Nobody waits on a range lock; the I/O owning a range
+    lock that is not granted right away is resumed when it is granted.
+--*/
+
+typedef struct _VIRTUAL_MINIPORT_RANGE_LOCK {
+    LIST_ENTRY List;
+    ULONGLONG Start;
+    ULONGLONG End;
+    BOOLEAN Exclusive;
+    BOOLEAN Granted;
+}VIRTUAL_MINIPORT_RANGE_LOCK, *PVIRTUAL_MINIPORT_RANGE_LOCK;
+
+
+/*++
+    Represents a read stream of a logical device, detected by the access
+    pattern of its reads. A read that starts where the last one ended continues
+    a sequential stream; a read that starts Stride blocks after the last one
+    continues a strided stream. Stride is learnt from the first two reads of a
+    stream that are not contiguous.
+--*/
+
+#define VIRTUAL_MINIPORT_PREFETCH_STREAMS 4
+#define VIRTUAL_MINIPORT_PREFETCH_MAX_STRIDE 1024      // Blocks
+#define VIRTUAL_MINIPORT_PREFETCH_MIN_HITS 2           // Reads following the pattern before prefetching
+#define VIRTUAL_MINIPORT_PREFETCH_MIN_DEPTH 0x10000    // Bytes
+
+typedef struct _VIRTUAL_MINIPORT_PREFETCH_STREAM {
+    ULONGLONG LastBlockNumber;             // First block of the last read
+    ULONG LastBlockCount;                  // 0 - Stream is unused
+    ULONG Stride;                          // 0 - Sequential
+    ULONG Hits;
+    ULONG LastUsed;
+    ULONGLONG PrefetchedBlockNumber;       // Stream is prefetched up to here
+}VIRTUAL_MINIPORT_PREFETCH_STREAM, *PVIRTUAL_MINIPORT_PREFETCH_STREAM;
+
+/*++
+    Heat of a region of a logical device, packed into a single 64-bit word so
+    that the read/write path updates it with a compare-exchange:
+    - Epoch - Decay interval of the last access; 20 bits
+    - Reads, Writes - Access counts decayed up to Epoch; 22 bits each,
+      saturating
+    Counts are halved for every decay interval elapsed since Epoch; they are
+    decayed as the region is accessed or queried, not by a timer.
+--*/
+
+#define VIRTUAL_MINIPORT_HEAT_DECAY_INTERVAL (100000000ULL)   // 10s, in 100ns
+
+#define VM_HEAT_COUNT_BITS 22
+#define VM_HEAT_COUNT_MAX ((1UL << VM_HEAT_COUNT_BITS) - 1)
+#define VM_HEAT_EPOCH_MASK ((1UL << (64 - (2 * VM_HEAT_COUNT_BITS))) - 1)
+
+#define VM_HEAT_EPOCH(_Heat_) ((ULONG) ((_Heat_) >> (2 * VM_HEAT_COUNT_BITS)))
+#define VM_HEAT_READS(_Heat_) ((ULONG) (((_Heat_) >> VM_HEAT_COUNT_BITS) & VM_HEAT_COUNT_MAX))
+#define VM_HEAT_WRITES(_Heat_) ((ULONG) ((_Heat_) & VM_HEAT_COUNT_MAX))
+
+#define VM_HEAT_BUILD(_Epoch_, _Reads_, _Writes_)                       \
+    (((ULONGLONG) (_Epoch_) << (2 * VM_HEAT_COUNT_BITS)) |              \
+     ((ULONGLONG) (_Reads_) << VM_HEAT_COUNT_BITS) |                    \
+     (ULONGLONG) (_Writes_))
+
+#define VM_HEAT_EPOCH_NOW() \
+    ((ULONG) ((KeQueryInterruptTime() / VIRTUAL_MINIPORT_HEAT_DECAY_INTERVAL) & VM_HEAT_EPOCH_MASK))
+
 /*++
     Represents a logical device, that represents a LUN
 --*/
@@ -198,12 +925,149 @@ typedef struct _VIRTUAL_MINIPORT_LOGICAL_DEVICE {
     PVIRTUAL_MINIPORT_TIERED_DEVICE PhysicalDevice;
     VM_LOCK LogicalDeviceLock;
 
-    VIRTUAL_MINIPORT_BLOCK_SIZE BlockSize;          // Bytes
+    ULONG BlockSize;                                // Bytes; allocation unit
+    VIRTUAL_MINIPORT_BLOCK_SIZE SectorSize;         // Bytes
+    ULONG SectorsPerBlock;
     ULONGLONG Size;                                 // Bytes
     ULONGLONG MaxBlocks;                            // Block count
 
     BOOLEAN ThinProvison;
     PVOID LogicalBlocks;
+    ULONG MapSlot;                                  // Slot of the persistent map
+
+    //
+    // Range locks granted and waiting, in arrival order. RangeLock is a spin
+    // lock, as the read/write moved inline takes range locks at DISPATCH_LEVEL.
+    //
+    VM_LOCK RangeLock;
+    LIST_ENTRY RangeLocks;
+
+    //
+    // I/Os are suspended across threads, so they cannot hold LogicalDeviceLock;
+    // deletion waits for the outstanding I/Os on the rundown reference instead.
+    //
+    EX_RUNDOWN_REF IoRundown;
+
+    //
+    // Read streams being prefetched. Depth is shared by the streams; it doubles
+    // when a read hits the prefetched blocks, and halves when a stream is
+    // dropped before reading all of its prefetched blocks.
+    //
+    VM_LOCK PrefetchLock;
+    ULONG PrefetchDepth;                            // Blocks
+    ULONG PrefetchClock;
+    VIRTUAL_MINIPORT_PREFETCH_STREAM PrefetchStreams [VIRTUAL_MINIPORT_PREFETCH_STREAMS];
+
+    //
+    // Heat of the regions of 1 << HeatRegionShift blocks; VM_HEAT_XXX
+    //
+    ULONG HeatRegionShift;
+    ULONG HeatRegionCount;
+    volatile LONG64 HeatRegions [VIRTUAL_MINIPORT_MAX_HEAT_REGIONS];
 }VIRTUAL_MINIPORT_LOGICAL_DEVICE, *PVIRTUAL_MINIPORT_LOGICAL_DEVICE;
 
+/*++
+    Represents a read/write or an unmap on a logical device. The I/O is a state machine
+    that runs on the scheduler threads until it has to wait, and is then
+    suspended; its owner is asked to resume it on a scheduler thread once the
+    wait is over. Nothing is waited on while holding a range lock, a pin or a
+    block lock, so a scheduler thread never waits on a suspended I/O.
+
+    - LockRange - Acquire the range lock; waits for the grant
+    - PinBlocks - Map and pin the blocks, deduplicating the blocks of a
+      write; waits if a block is being moved
+    - UnmapBlocks - Unmap the blocks of an unmap; waits if a block is being moved
+    - ResolveExtent - Resolve the next extent and start moving it
+    - DataMoved - File tier I/O of the data buffer is done
+    - VictimsWritten - Victims are written in place of the extent being promoted
+    - NextPass - Start the next pass of an I/O not aligned to the allocation unit
+    - Release - Release the blocks of the pass; and once the passes are done,
+      everything held, I/O is done
+
+    Sectors of an I/O not aligned to the allocation unit are moved through a
+    bounce buffer of whole blocks, in passes over the range locked once:
+    - Read - Read the blocks into the bounce buffer, copy the sectors out
+    - Write - Read the partial head and tail blocks, copy the sectors in,
+      write the blocks
+    - Unmap - Read the partial head and tail blocks, zero the sectors, write
+      them back; unmap the whole blocks in between
+--*/
+
+typedef enum _VIRTUAL_MINIPORT_DEVICE_IO_STATE {
+    VMDeviceIoStateLockRange,
+    VMDeviceIoStatePinBlocks,
+    VMDeviceIoStateUnmapBlocks,
+    VMDeviceIoStateResolveExtent,
+    VMDeviceIoStateDataMoved,
+    VMDeviceIoStateVictimsWritten,
+    VMDeviceIoStateNextPass,
+    VMDeviceIoStateRelease,
+    VMDeviceIoStateDone
+}VIRTUAL_MINIPORT_DEVICE_IO_STATE, *PVIRTUAL_MINIPORT_DEVICE_IO_STATE;
+
+/*++
+
+    Type definition of the routine that resumes a suspended device I/O;
+    Context - ResumeContext of the device I/O
+
+--*/
+
+typedef VOID (*PVIRTUAL_MINIPORT_DEVICE_IO_RESUME)(PVOID Context);
+
+//
+// Passes of a device I/O not aligned to the allocation unit; run lowest first
+//
+
+#define VM_DEVICE_IO_PASS_READ_HEAD  (1 << 0)     // Partial first block
+#define VM_DEVICE_IO_PASS_READ_TAIL  (1 << 1)     // Partial last block
+#define VM_DEVICE_IO_PASS_READ       (1 << 2)     // All the blocks
+#define VM_DEVICE_IO_PASS_WRITE_HEAD (1 << 3)
+#define VM_DEVICE_IO_PASS_WRITE_TAIL (1 << 4)
+#define VM_DEVICE_IO_PASS_WRITE      (1 << 5)
+#define VM_DEVICE_IO_PASS_UNMAP      (1 << 6)     // Whole blocks in between
+
+typedef struct _VIRTUAL_MINIPORT_DEVICE_IO {
+    PVOID AdapterExtension;
+    PVIRTUAL_MINIPORT_LOGICAL_DEVICE LogicalDevice;
+    BOOLEAN Read;
+    BOOLEAN Unmap;
+    VIRTUAL_MINIPORT_DEVICE_IO_STATE State;
+    NTSTATUS Status;
+
+    PVOID Buffer;                       // Data of the extent being moved
+    ULONGLONG LogicalBlockNumber;
+    ULONGLONG LastBlockNumber;
+    ULONGLONG BlockIndex;               // First block of the extent being moved
+    ULONGLONG PinnedBlockNumber;        // Blocks below it are pinned
+    ULONG TransferredBytes;
+
+    VIRTUAL_MINIPORT_RANGE_LOCK RangeLock;
+    VIRTUAL_MINIPORT_EXTENT Extent;
+
+    //
+    // Sectors of an I/O not aligned to the allocation unit, and the bounce
+    // buffer they are moved through. Bounce buffer holds all the blocks of a
+    // read/write, and the head and tail blocks of an unmap.
+    //
+    PVOID SectorBuffer;                 // Caller's buffer
+    ULONGLONG SectorNumber;
+    ULONG SectorCount;
+    PVOID BounceBuffer;
+    ULONGLONG FirstBlockNumber;         // Blocks range locked
+    ULONGLONG EndBlockNumber;
+    ULONG Passes;                       // VM_DEVICE_IO_PASS_XXX left to run
+
+    //
+    // Staging buffer owned by the I/O for promotions; taken from the scheduler
+    // thread or the spare pool, and returned to the spare pool
+    //
+    PVOID StagingBuffer;
+
+    VIRTUAL_MINIPORT_FILE_IO FileIo;
+    NTSTATUS FileIoStatus;
+
+    PVIRTUAL_MINIPORT_DEVICE_IO_RESUME ResumeRoutine;
+    PVOID ResumeContext;
+}VIRTUAL_MINIPORT_DEVICE_IO, *PVIRTUAL_MINIPORT_DEVICE_IO;
+
 #endif // __VIRTUAL_MINIPORT_DEVICE_TYPES_H_
\ No newline at end of file
@@ -26,6 +26,35 @@ Abstract:
 #include <VirtualMiniportSupportRoutines.h>
 #include <VirtualMiniportTrace.h>
 
+//
+// Asynchronous file I/O
+//
+
+typedef struct _VIRTUAL_MINIPORT_FILE_IO *PVIRTUAL_MINIPORT_FILE_IO;
+
+/*++
+
+    Type definition of the completion routine of an asynchronous file I/O.
+    Called at IRQL <= DISPATCH_LEVEL, only if the I/O went pending.
+
+--*/
+
+typedef VOID (*PVIRTUAL_MINIPORT_FILE_IO_COMPLETION)(PVIRTUAL_MINIPORT_FILE_IO FileIo, NTSTATUS Status);
+
+typedef struct _VIRTUAL_MINIPORT_FILE_IO {
+    IO_STATUS_BLOCK IoStatus;
+    ULONG Length;
+
+    //
+    // Submitter and completion routine both increment it; whoever comes second
+    // owns the completion. This way the completion routine is not invoked for
+    // an I/O that completed before the submission returned.
+    //
+    volatile LONG CompletionOwner;
+
+    PVIRTUAL_MINIPORT_FILE_IO_COMPLETION CompletionRoutine;
+}VIRTUAL_MINIPORT_FILE_IO;
+
 NTSTATUS
 VMFileCreate(
     _In_ PUNICODE_STRING FileName,
@@ -53,4 +82,26 @@ VMFileReadWrite(
     _In_ BOOLEAN Read
     );
 
+NTSTATUS
+VMFileFlush(
+    _In_ HANDLE File
+    );
+
+NTSTATUS
+VMFileReferenceObject(
+    _In_ HANDLE File,
+    _Out_ PFILE_OBJECT *FileObject
+    );
+
+NTSTATUS
+VMFileReadWriteAsync(
+    _In_ PFILE_OBJECT FileObject,
+    _Inout_ PVOID Buffer,
+    _In_ ULONG BufferLength,
+    _In_ ULONGLONG FileOffset,
+    _In_ BOOLEAN Read,
+    _Inout_ PVIRTUAL_MINIPORT_FILE_IO FileIo,
+    _In_ PVIRTUAL_MINIPORT_FILE_IO_COMPLETION CompletionRoutine
+    );
+
 #endif // __VIRTUAL_MINIPORT_FILE_H_
\ No newline at end of file
@@ -0,0 +1,162 @@
+/*++
+
+Module Name:
+
+    VirtualMiniportJournal.h
+
+Date:
+
+    17-Oct-2026
+
+Abstract:
+
+    Module contains the prototypes of the persistent map of a tiered device
+
+--*/
+
+#ifndef __VIRTUAL_MINIPORT_JOURNAL_H_
+#define __VIRTUAL_MINIPORT_JOURNAL_H_
+
+#include <wdm.h>
+#include <ntstrsafe.h>
+#include <storport.h>
+
+#include <VirtualMiniportWrapper.h>
+#include <VirtualMiniportSupportRoutines.h>
+#include <VirtualMiniportTrace.h>
+#include <VirtualMiniportAdapter.h>
+#include <VirtualMiniportDeviceTypes.h>
+
+//
+// Map file is named after the backing file of the first level of the file
+// tier
+//
+
+#define VIRTUAL_MINIPORT_MAP_FILE_EXTENSION L".map"
+
+//
+// Logical device that has no slot in the persistent map
+//
+
+#define VM_JOURNAL_INVALID_SLOT MAXULONG
+
+//
+// RAM tier is saved past the file tier blocks of the backing file of the
+// first level, a RAM tier block at the offset of its tier block number
+//
+
+#define VM_JOURNAL_MEMORY_IMAGE_OFFSET(_Device_, _TierBlockNumber_)                 \
+    (((_Device_)->FileTiers [0].MaxBlocks * (_Device_)->BlockSize) +                \
+     ((ULONGLONG) (_TierBlockNumber_) * (_Device_)->BlockSize))
+
+//
+// Marks the device written. Set once the data is in place, so that a clean
+// checkpoint saving the RAM tier either has the data or sees the device
+// written; and a clean map file is made dirty by the next commit.
+//
+
+#define VM_JOURNAL_DIRTY(_Device_)                      \
+    do {                                                \
+        if ( (_Device_)->Journal.Dirty == FALSE ) {     \
+            (_Device_)->Journal.Dirty = TRUE;           \
+        }                                               \
+    } while ( 0 )
+
+/*++
+    Represents a sequential stream of the checkpoint, read or written through
+    a staging buffer of VIRTUAL_MINIPORT_JOURNAL_BUFFER_SIZE bytes. Checksum
+    is chained over the chunks of the stream as they are read or written.
+--*/
+
+typedef struct _VIRTUAL_MINIPORT_MAP_STREAM {
+    HANDLE File;
+    PUCHAR Buffer;
+    ULONG Position;                            // In the buffer
+    ULONG Available;                           // Bytes in the buffer; read stream
+    ULONGLONG Offset;                          // File offset of the next chunk
+    ULONGLONG Remaining;                       // Bytes left to read; read stream
+    ULONG Checksum;
+}VIRTUAL_MINIPORT_MAP_STREAM, *PVIRTUAL_MINIPORT_MAP_STREAM;
+
+//
+// Map file management
+//
+
+NTSTATUS
+VMJournalOpen(
+    _In_ PVIRTUAL_MINIPORT_ADAPTER_EXTENSION AdapterExtension,
+    _Inout_ PVIRTUAL_MINIPORT_TIERED_DEVICE Device
+    );
+
+VOID
+VMJournalClose(
+    _In_ PVIRTUAL_MINIPORT_ADAPTER_EXTENSION AdapterExtension,
+    _Inout_ PVIRTUAL_MINIPORT_TIERED_DEVICE Device
+    );
+
+NTSTATUS
+VMJournalCommit(
+    _Inout_ PVIRTUAL_MINIPORT_TIERED_DEVICE Device
+    );
+
+NTSTATUS
+VMJournalCheckpoint(
+    _Inout_ PVIRTUAL_MINIPORT_TIERED_DEVICE Device
+    );
+
+NTSTATUS
+VMJournalCheckpointClean(
+    _Inout_ PVIRTUAL_MINIPORT_TIERED_DEVICE Device
+    );
+
+//
+// Logical device maps
+//
+
+ULONG
+VMJournalFindRestoredSlot(
+    _In_ PVIRTUAL_MINIPORT_TIERED_DEVICE Device,
+    _In_ ULONG Lun
+    );
+
+NTSTATUS
+VMJournalAttachLogicalDevice(
+    _In_ PVIRTUAL_MINIPORT_ADAPTER_EXTENSION AdapterExtension,
+    _Inout_ PVIRTUAL_MINIPORT_TIERED_DEVICE Device,
+    _Inout_ PVIRTUAL_MINIPORT_LOGICAL_DEVICE LogicalDevice,
+    _In_ ULONG Slot,
+    _In_ ULONG Lun
+    );
+
+VOID
+VMJournalDetachLogicalDevice(
+    _Inout_ PVIRTUAL_MINIPORT_TIERED_DEVICE Device,
+    _Inout_ PVIRTUAL_MINIPORT_LOGICAL_DEVICE LogicalDevice
+    );
+
+VOID
+VMJournalReleaseRestoredSlot(
+    _Inout_ PVIRTUAL_MINIPORT_TIERED_DEVICE Device,
+    _In_ ULONG Slot
+    );
+
+//
+// Logging of the block changes
+//
+
+VOID
+VMJournalLogPhysicalBlocks(
+    _Inout_ PVIRTUAL_MINIPORT_TIERED_DEVICE Device,
+    _In_ ULONG PhysicalBlockIndex,
+    _In_ ULONG OtherPhysicalBlockIndex
+    );
+
+VOID
+VMJournalLogLogicalBlock(
+    _Inout_ PVIRTUAL_MINIPORT_TIERED_DEVICE Device,
+    _In_ PVIRTUAL_MINIPORT_LOGICAL_DEVICE LogicalDevice,
+    _In_ PVIRTUAL_MINIPORT_LOGICAL_BLOCK_ENTRY LogicalBlockEntry,
+    _In_ ULONG PhysicalBlockIndex
+    );
+
+#endif //__VIRTUAL_MINIPORT_JOURNAL_H_
@@ -83,4 +83,18 @@ VMLunQueryById(
     _In_ BOOLEAN Reference
     );
 
+NTSTATUS
+VMLunReferenceByAddress(
+    _In_ PVIRTUAL_MINIPORT_ADAPTER_EXTENSION AdapterExtension,
+    _In_ UCHAR BusId,
+    _In_ UCHAR TargetId,
+    _In_ UCHAR LunId,
+    _Out_ PVIRTUAL_MINIPORT_LUN *Lun
+    );
+
+VOID
+VMLunDereference(
+    _In_ PVIRTUAL_MINIPORT_LUN Lun
+    );
+
 #endif //__VIRTUAL_MINIPORT_TARGET_H_
\ No newline at end of file
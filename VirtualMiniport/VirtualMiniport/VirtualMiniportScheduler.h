@@ -49,16 +49,33 @@ typedef enum _VM_SCHEDULER_STATE {
 //
 
 typedef struct _VIRTUAL_MINIPORT_SCHEDULER_WORKITEM *PVIRTUAL_MINIPORT_SCHEDULER_WORKITEM;
+typedef struct _VIRTUAL_MINIPORT_SCHEDULER_FLOW *PVIRTUAL_MINIPORT_SCHEDULER_FLOW;
 
 /*++
 
     Type definition for scheduler worker routine;
     WorkItem - PVIRTUAL_MINIPORT_SCHEDULER_WORKITEM
 
+    Worker returns STATUS_PENDING if it suspended the work item on an
+    asynchronous operation; the work item is handed back to the scheduler
+    with VMSchedulerResumeWorkItem when the operation completes, and the
+    worker is invoked on it again.
+
 --*/
 
 typedef NTSTATUS(*PVIRTUAL_MINIPORT_SCHEDULER_WORKER)(PVIRTUAL_MINIPORT_SCHEDULER_WORKITEM WorkItem, BOOLEAN AbortRequests);
 
+/*++
+
+    Type definition for completion routine of a work item whose completion
+    the worker deferred with VMSchedulerDeferCompletion. Scheduler thread
+    invokes the completion routines of a batch back to back, once the batch
+    is processed.
+
+--*/
+
+typedef VOID(*PVIRTUAL_MINIPORT_SCHEDULER_COMPLETION)(PVIRTUAL_MINIPORT_SCHEDULER_WORKITEM WorkItem);
+
 /*++
 
     Scheduler hint will be passed in the SRB extension for the scheduler thread
@@ -117,12 +134,110 @@ typedef struct _VIRTUAL_MINIPORT_SCHEDULER_WORKITEM {
     VM_SCHEDULER_WORKITEM_STATUS Status;
 
     PVIRTUAL_MINIPORT_SCHEDULER_WORKER Worker;
+
+    //
+    // Interrupt time the work item was queued at; measures the queue wait
+    //
+    ULONGLONG QueuedTime;
+
+    //
+    // Staging buffer slot of the scheduler thread; lent to the work item only
+    // for the duration of the worker routine. Slot can hold NULL. Worker can
+    // take the buffer over by clearing the slot, and returns it later with
+    // VMSchedulerFreeStagingBuffer; thread refills its slot from spare pool.
+    //
+    PVOID *StagingBuffer;
+
+    //
+    // Completion list of the scheduler thread; lent to the work item only for
+    // the duration of the worker routine. NULL if the thread does not batch
+    // the completions. Completion is the routine the worker deferred to.
+    //
+    PLIST_ENTRY CompletionList;
+    PVIRTUAL_MINIPORT_SCHEDULER_COMPLETION Completion;
+
+    //
+    // Flow the work item is scheduled on, and its cost in bytes; set by the
+    // caller before the work item is scheduled. NULL if the work item goes
+    // straight to the work queues.
+    //
+    PVIRTUAL_MINIPORT_SCHEDULER_FLOW Flow;
+    ULONG Cost;
 }VIRTUAL_MINIPORT_SCHEDULER_WORKITEM, *PVIRTUAL_MINIPORT_SCHEDULER_WORKITEM;
 
+/*++
+
+    Flow is a stream of work items that is scheduled fairly against the other
+    flows of the scheduler, such as the requests of a Lun. Work items of a
+    flow wait in its own queue; scheduler threads take turns among the flows
+    that have work items queued, by deficit round robin, and each flow gets
+    to dispatch Weight * VIRTUAL_MINIPORT_SCHEDULER_FLOW_QUANTUM bytes in its
+    turn.
+
+    Flow can also be limited to a rate of work items and bytes, with a token
+    bucket each. Buckets hold a burst of VIRTUAL_MINIPORT_SCHEDULER_FLOW_BURST_TIME
+    worth of tokens. Dispatch can take a bucket into debt; flow in debt is
+    throttled, and is taken back into turns when its buckets refill.
+
+    Flow is accessed under the flow lock of the scheduler, but for its
+    statistics. Work items are queued to the flow only while it is attached.
+
+--*/
+
+typedef enum _VM_SCHEDULER_FLOW_STATE {
+    VMFlowIdle,         // No work items queued
+    VMFlowActive,       // Takes turns on the active flows of the scheduler
+    VMFlowThrottled     // Waits on the throttled flows of the scheduler
+}VM_SCHEDULER_FLOW_STATE, *PVM_SCHEDULER_FLOW_STATE;
+
+typedef struct _VIRTUAL_MINIPORT_SCHEDULER_FLOW {
+    LIST_ENTRY List;        // Active or throttled flows of the scheduler
+    LIST_ENTRY WorkItems;
+    ULONG WorkItemCount;
+    VM_SCHEDULER_FLOW_STATE State;
+    BOOLEAN Attached;
+
+    //
+    // Share of the flow, and its limits; 0 is unlimited
+    //
+    ULONG Weight;
+    ULONGLONG IopsLimit;                            // Work items per second
+    ULONGLONG BandwidthLimit;                       // Bytes per second
+
+    //
+    // Bytes left to dispatch in the turn. Tokens are in units of a work item,
+    // or of a byte, per VIRTUAL_MINIPORT_SCHEDULER_FLOW_SECOND; buckets refill
+    // by their limit every 100ns. ReleaseTime is when the flow was taken back
+    // into turns, as its work items do not wait on the scheduler until then.
+    //
+    LONGLONG Deficit;
+    LONGLONG IoTokens;
+    LONGLONG ByteTokens;
+    ULONGLONG RefillTime;
+    ULONGLONG ReleaseTime;
+
+    //
+    // Statistics
+    //
+    volatile LONGLONG DispatchedWorkItems;
+    volatile LONGLONG DispatchedBytes;
+    volatile LONGLONG ThrottledCount;
+}VIRTUAL_MINIPORT_SCHEDULER_FLOW, *PVIRTUAL_MINIPORT_SCHEDULER_FLOW;
+
 /*
 
 Scheduler thread binds a work item and a thread.
 
+Each scheduler thread owns a queue of work items. Work items are queued to
+the queue of the thread the submitting processor maps to, and only the owner
+is woken; a thread that drained its own queue steals from its neighbours
+before going back to wait.
+
+Threads occupy the slots from 0 up to ThreadCount of the scheduler. Only the
+thread of the last slot retires, and only with an empty queue; its queue is
+marked Retired under the queue lock, and work items are queued to slot 0 in
+its place until the slot is taken again.
+
 */
 
 typedef struct _VIRTUAL_MINIPORT_SCHEDULER_THREAD {
@@ -130,6 +245,26 @@ typedef struct _VIRTUAL_MINIPORT_SCHEDULER_THREAD {
     BOOLEAN IsValid;
     PETHREAD Thread;
     VIRTUAL_MINIPORT_SCHEDULER_WORKITEM ControlItem;
+
+    //
+    // Backward pointer to the scheduler, and our slot in it
+    //
+    struct _VIRTUAL_MINIPORT_SCHEDULER_DATABASE *SchedulerDatabase;
+    ULONG Index;
+
+    //
+    // Work queue of the thread. WorkItemCount is updated under QueueLock,
+    // but is read without it to skip empty queues while stealing.
+    //
+    VM_LOCK QueueLock;                              // Should be spinlock
+    LIST_ENTRY WorkItems;
+    volatile LONG WorkItemCount;
+    BOOLEAN Retired;                                // Under QueueLock
+
+    //
+    // Synchronization event; wakes only the owner thread
+    //
+    KEVENT WorkQueuedEvent;
 }VIRTUAL_MINIPORT_SCHEDULER_THREAD, *PVIRTUAL_MINIPORT_SCHEDULER_THREAD;
 
 /*++
@@ -140,10 +275,44 @@ Scheduler state machine is described in scheduler module
 --*/
 
 //
-// MAX threads is configured to 4 as of now.
+// Scheduler starts with its minimum number of threads, and adds a thread when
+// the work items wait in the queues longer than the grow wait time on average,
+// or when a thread finds a full batch in its queue; no more often than the
+// resize interval. Thread of the last slot retires after idling for the idle
+// timeout, down to the minimum. Times are in 100ns units.
 //
 
-#define VIRTUAL_MINIPORT_SCHEDULER_MAX_THREAD 16
+#define VIRTUAL_MINIPORT_SCHEDULER_GROW_WAIT_TIME (2LL * 1000LL * 10LL)         // 2 milliseconds
+#define VIRTUAL_MINIPORT_SCHEDULER_RESIZE_INTERVAL (10LL * 1000LL * 10LL)       // 10 milliseconds
+#define VIRTUAL_MINIPORT_SCHEDULER_IDLE_TIMEOUT (5000LL * 1000LL * 10LL)        // 5 seconds
+
+//
+// Each scheduler thread owns a staging buffer sized for the largest transfer
+// the tiered device moves at once (VIRTUAL_MINIPORT_MAX_EXTENT_SIZE). Spare
+// buffers serve bursts from contexts that do not own one.
+//
+
+#define VIRTUAL_MINIPORT_SCHEDULER_STAGING_BUFFER_SIZE (0x00040000UL)
+#define VIRTUAL_MINIPORT_SCHEDULER_SPARE_STAGING_BUFFERS 4
+
+//
+// Scheduler thread detaches up to this many work items from its queue per
+// lock acquisition, and completes them together once they are processed
+//
+
+#define VIRTUAL_MINIPORT_SCHEDULER_BATCH_SIZE 16
+
+//
+// Flows dispatch this many bytes per unit of their weight in each turn, and
+// a work item costs at least the minimum cost in its turn. Token buckets of
+// the flows hold a burst of tokens worth the burst time. Times are in 100ns
+// units.
+//
+
+#define VIRTUAL_MINIPORT_SCHEDULER_FLOW_QUANTUM 1024
+#define VIRTUAL_MINIPORT_SCHEDULER_FLOW_MIN_COST 4096
+#define VIRTUAL_MINIPORT_SCHEDULER_FLOW_SECOND (1000LL * 1000LL * 10LL)         // 1 second
+#define VIRTUAL_MINIPORT_SCHEDULER_FLOW_BURST_TIME (100LL * 1000LL * 10LL)      // 100 milliseconds
 
 typedef struct _VIRTUAL_MINIPORT_SCHEDULER_DATABASE {
     VM_LOCK SchedulerLock;                          // Should be spinlock
@@ -151,32 +320,61 @@ typedef struct _VIRTUAL_MINIPORT_SCHEDULER_DATABASE {
 
     VM_SCHEDULER_STATE SchedulerState;
     volatile ULONG ActiveThreadCount;
+    ULONG MinThreads;
     ULONG MaxThreads;
 
-    LIST_ENTRY WorkItems;
-    ULONGLONG WorkItemCount;
+    //
+    // Slots in use; work items are spread over them. Resizing serializes the
+    // threads that grow or shrink the thread set, and ResizeTime is when the
+    // set last grew. WaitTime is the moving average of the queue wait.
+    //
+    volatile LONG ThreadCount;
+    volatile LONG Resizing;
+    ULONGLONG ResizeTime;
+    volatile LONGLONG WaitTime;
+
+    //
+    // Work items suspended by the workers and not resumed yet. Scheduler
+    // threads do not terminate until they are resumed and processed.
+    //
+    volatile LONG PendingWorkItemCount;
 
     //
     // Scheduler specific events.
     // -    Set at any level
     // -    Waited at only passive
-    // -    These are manual reset events
+    // -    This is manual reset event; work queued events are per thread
 
-    KEVENT WorkQueuedEvent;
     KEVENT ShutdownEvent;
 
     //
-    // Each scheduler thread binds to a Control item. We can use the control item
-    // to control the behavior of its owner thread. THreads are now embedded as they
-    // are now controlled by VIRTUAL_MINIPORT_SCHEDULER_MAX_THREAD. Ideally it
-    // would make sense to dynamically to the scheduler owner's configuration;
+    // Lock-free pool of spare staging buffers
+    //
+
+    SLIST_HEADER SpareStagingBuffers;
+
+    //
+    // Flows of the scheduler; backlogged flows take turns on ActiveFlows, and
+    // flows over their limits wait on ThrottledFlows for the throttle timer.
+    // FlowWorkItemCount is updated under FlowLock, but is read without it to
+    // skip the flows when none has work items queued.
+    //
+
+    VM_LOCK FlowLock;                               // Should be spinlock
+    LIST_ENTRY ActiveFlows;
+    LIST_ENTRY ThrottledFlows;
+    volatile LONG FlowWorkItemCount;
+    KTIMER ThrottleTimer;
+    KDPC ThrottleDpc;
+
     //
-    // i.e. if adapter owns the scheduler, we create scheduler threads based on
-    // adapter's number of buses. If scheduler is owned by target, thread count
-    // is configured by number of lun's on the target
+    // Each scheduler thread binds to a Control item. We can use the control item
+    // to control the behavior of its owner thread. Slots are allocated for the
+    // configured maximum of threads, which defaults to the number of processors;
+    // threads come and go with the load of the owner.
     //
 
-    VIRTUAL_MINIPORT_SCHEDULER_THREAD SchedulerThread [VIRTUAL_MINIPORT_SCHEDULER_MAX_THREAD];
+    PVIRTUAL_MINIPORT_SCHEDULER_THREAD SchedulerThread;
 }VIRTUAL_MINIPORT_SCHEDULER_DATABASE, *PVIRTUAL_MINIPORT_SCHEDULER_DATABASE;
 
 //
@@ -186,7 +384,9 @@ typedef struct _VIRTUAL_MINIPORT_SCHEDULER_DATABASE {
 NTSTATUS
 VMSchedulerInitialize (
     _Inout_ PVOID AdapterExtension,
-    _Inout_ PVIRTUAL_MINIPORT_SCHEDULER_DATABASE SchedulerDatabase
+    _Inout_ PVIRTUAL_MINIPORT_SCHEDULER_DATABASE SchedulerDatabase,
+    _In_ ULONG MinThreads,
+    _In_ ULONG MaxThreads
     );
 
 NTSTATUS
@@ -228,4 +428,66 @@ VMSchedulerScheduleWorkItem (
     _In_ BOOLEAN AcquiredSchedulerLock
     );
 
+VOID
+VMSchedulerInitializeFlow (
+    _Out_ PVIRTUAL_MINIPORT_SCHEDULER_FLOW Flow,
+    _In_ ULONG Weight
+    );
+
+VOID
+VMSchedulerAttachFlow (
+    _In_ PVIRTUAL_MINIPORT_SCHEDULER_DATABASE SchedulerDatabase,
+    _Inout_ PVIRTUAL_MINIPORT_SCHEDULER_FLOW Flow
+    );
+
+VOID
+VMSchedulerDetachFlow (
+    _In_ PVIRTUAL_MINIPORT_SCHEDULER_DATABASE SchedulerDatabase,
+    _Inout_ PVIRTUAL_MINIPORT_SCHEDULER_FLOW Flow
+    );
+
+NTSTATUS
+VMSchedulerSetFlow (
+    _In_ PVIRTUAL_MINIPORT_SCHEDULER_DATABASE SchedulerDatabase,
+    _Inout_ PVIRTUAL_MINIPORT_SCHEDULER_FLOW Flow,
+    _In_ ULONG Weight,
+    _In_ ULONGLONG IopsLimit,
+    _In_ ULONGLONG BandwidthLimit
+    );
+
+BOOLEAN
+VMSchedulerFlowIsIdle (
+    _In_ PVIRTUAL_MINIPORT_SCHEDULER_FLOW Flow
+    );
+
+VOID
+VMSchedulerChargeFlow (
+    _In_ PVIRTUAL_MINIPORT_SCHEDULER_DATABASE SchedulerDatabase,
+    _Inout_ PVIRTUAL_MINIPORT_SCHEDULER_FLOW Flow,
+    _In_ ULONG Cost
+    );
+
+VOID
+VMSchedulerResumeWorkItem (
+    _In_ PVIRTUAL_MINIPORT_SCHEDULER_DATABASE SchedulerDatabase,
+    _In_ PVIRTUAL_MINIPORT_SCHEDULER_WORKITEM WorkItem
+    );
+
+BOOLEAN
+VMSchedulerDeferCompletion (
+    _Inout_ PVIRTUAL_MINIPORT_SCHEDULER_WORKITEM WorkItem,
+    _In_ PVIRTUAL_MINIPORT_SCHEDULER_COMPLETION Completion
+    );
+
+PVOID
+VMSchedulerAllocateStagingBuffer (
+    _In_ PVIRTUAL_MINIPORT_SCHEDULER_DATABASE SchedulerDatabase
+    );
+
+VOID
+VMSchedulerFreeStagingBuffer (
+    _In_ PVIRTUAL_MINIPORT_SCHEDULER_DATABASE SchedulerDatabase,
+    _In_ PVOID StagingBuffer
+    );
+
 #endif //__VIRTUAL_MINIPORT_SCHEDULER_H_
\ No newline at end of file
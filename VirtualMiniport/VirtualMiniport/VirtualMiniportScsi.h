@@ -37,4 +37,10 @@ VMSrbExecuteScsi(
     _In_ PSCSI_REQUEST_BLOCK Srb
     );
 
+BOOLEAN
+VMSrbFlush(
+    _In_ PVIRTUAL_MINIPORT_ADAPTER_EXTENSION AdapterExtension,
+    _In_ PSCSI_REQUEST_BLOCK Srb
+    );
+
 #endif //__VIRTUAL_MINIPORT_SCSI_H_
\ No newline at end of file
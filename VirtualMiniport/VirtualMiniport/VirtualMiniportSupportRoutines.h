@@ -57,5 +57,33 @@ VMRtlBugcheck(
 VOID
 VMRtlDebugBreak();
 
+BOOLEAN
+VMRtlIsZeroMemory(
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ SIZE_T Length
+    );
+
+ULONG
+VMRtlHashMemory(
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ SIZE_T Length
+    );
+
+ULONG
+VMRtlCompressMemory(
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ ULONG Length,
+    _Out_writes_bytes_to_(CompressedLength, return) PVOID CompressedBuffer,
+    _In_ ULONG CompressedLength
+    );
+
+BOOLEAN
+VMRtlDecompressMemory(
+    _In_reads_bytes_(CompressedLength) PVOID CompressedBuffer,
+    _In_ ULONG CompressedLength,
+    _Out_writes_bytes_(Length) PVOID Buffer,
+    _In_ ULONG Length
+    );
+
 #endif // __VIRTUAL_MINIPORT_SUPPORT_ROUTINES_H_
 
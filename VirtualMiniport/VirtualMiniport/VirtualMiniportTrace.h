@@ -56,6 +56,7 @@ Abstract:
     WPP_DEFINE_BIT(VM_TRACE_SCHEDULER)  \
     WPP_DEFINE_BIT(VM_TRACE_TIER_MEMORY) \
     WPP_DEFINE_BIT(VM_TRACE_TIER_FILE) \
+    WPP_DEFINE_BIT(VM_TRACE_JOURNAL)   \
     )
 
 //